@@ -1,326 +1,1524 @@
 #include <stdio.h>
-#include "jpeglib.h"
+#include <stdint.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-#define ROUND(x) (int) ( 0.5f + x )
+#include "jtoa.h"
+#include "jtoa_cache.h"
+#include "jtoa_bench.h"
+#include "jtoa_util.h"
 
-typedef struct Image_ {
-	int width;
-	int height;
-	float *pixel;
-	int *yadds;
-	float resize_y;
-	float resize_x;
-	int *lookup_resx;
-} Image;
+// Conversion options, see jtoa.h
+jtoa_ctx options;
+
+#define STATS_TEXT 1
+#define STATS_JSON 2
 
 // Options with defaults
-int verbose = 0;
-int auto_height = 1;
-int auto_width = 0;
-int width = 78;
-int height = 0;
-int progress_barlength = 56;
-int invert = 0;
-int flipx = 0;
-int flipy = 0;
+int jobs = 0; // 0 picks a default after parsing
+int use_mmap = 0;
+int stream = 0;
+int info = 0;
+const char *serve_path = NULL;
+const char *cache_dir = NULL;
+long cache_size = 100; // MB
+double max_fps = 0;
+int stats = 0; // STATS_*
+int bench_runs = 0;
+const char *synthetic = NULL;
+
+// files to convert, in argument order
+const char **file_names = NULL;
+int file_count = 0;
 
-#define ASCII_PALETTE_SIZE 256
+// --widths, rendered from one decode and printed one after the other
+int widths[JTOA_MAX_WIDTHS];
+int width_count = 0;
 
-char ascii_palette[ASCII_PALETTE_SIZE+1] = "";
-const char* default_palette = "   ...',;:clodxkO0KXNWM";
+// conversion options given on the command line, the defaults of --serve
+const char **conversion_args = NULL;
+int conversion_count = 0;
 
 void help() {
 	fputs("Usage: jtoa [ options ] [ file(s) ]\n\n"
 
-	"Convert files in JPEG format to ASCII.\n\n"
+	"Convert files in JPEG format to ASCII.  PNG and WebP files are converted too if\n"
+	"libjtoa was built with them (make PNG=1 WEBP=1).\n\n"
 	"OPTIONS\n"
+	"    --bench[=N]  Time N (default 10) conversions of the files and --synthetic image from\n"
+	"                 memory, and print the time of each stage and the throughput.\n"
+	"    --cache=DIR  Keep rendered frames in DIR, and reuse them for files with the same content\n"
+	"                 and options.  DIR can be shared by several processes.\n"
+	"    --cache-size=N  Evict the least recently used frames above N MB in the cache (default 100).\n"
 	"    --chars=...  Leftmost char corresponds to black pixel, right-most to white (specify at least 2 characters).\n"
+	"    --color=...  Color each char with the average color of its cell: 'truecolor', '256' or\n"
+	"                 '16' color escapes, or 'none' (default).  Chars are picked as with\n"
+	"                 --luma=average.\n"
+	"    --crop=X,Y,WxH  Only convert the source region of WxH pixels at X,Y.\n"
+	"    --dct-scale  Let libjpeg (or libwebp) downscale while decoding, to the smallest size not below\n"
+	"                 the output size.\n"
+	"    --dither=... Dither between the levels of the chars: 'none' (default), 'bayer' (4x4\n"
+	"                 ordered) or 'floyd' (Floyd-Steinberg error diffusion).\n"
+	"    --fast       Only decode the source row nearest to each output row (faster, less smoothing).\n"
+	"    --filter=... Horizontal resampling: 'nearest' (default) samples one source pixel per\n"
+	"                 column, 'box' averages all source pixels covered by the column.\n"
 	"    --flipx      Flip image in X direction.\n"
 	"    --flipy      Flip image in Y direction.\n"
+	"    --fps=N      With --stream, draw at most N frames per second.\n"
+	"    --glyphs=... Draw each char from 'ascii' (default) a single intensity, or set pixels of\n"
+	"                 'halfblock' (1x2), 'quadrant' (2x2) or 'braille' (2x4) UTF-8 chars.\n"
 	"    --height=N   Set output height, calculate width from aspect ratio.\n"
 	"-h, --help       Print program help.\n"
+	"    --info       Only print source size, components and output size of each file, from the header.\n"
 	"-i, --invert     Invert output image.  Use if your display has a dark background.\n"
+	"-j N, --jobs=N   Convert N files in parallel.  Output stays in argument order.\n"
+	"    --luma=...   How to compute intensity from color images: 'rec601' (default) decodes only\n"
+	"                 the luminance plane, 'average' decodes RGB and averages the components.\n"
+	"    --mmap       Memory map input files instead of reading them through stdio.\n"
+	"    --preview[=N]  Only decode the first (or first N) scans of progressive JPEGs.\n"
+	"    --rows=N     Decode N scanlines per libjpeg call (default 16).\n"
+	"    --serve=PATH Convert requests from clients of a Unix socket at PATH on -j threads\n"
+	"                 (default one per processor).  Options given here are the defaults.\n"
+	"    --simd=...   Instruction set for resampling and accumulation: auto (default), scalar,\n"
+	"                 sse2, avx2 or neon.  Nearest neighbour resampling is scalar except on avx2.\n"
 	"    --size=WxH   Set output width and height.\n"
+	"    --stream     Read concatenated JPEGs (e.g. MJPEG) from stdin and redraw each in place,\n"
+	"                 sending only the changed cells.  Frames arriving while one is being drawn\n"
+	"                 replace each other.\n"
+	"    --stats[=...]  Print the counters and stage times of each file to stderr, as 'text'\n"
+	"                 (default) or one 'json' object per line.\n"
+	"    --synthetic=WxH[,SAMPLING]  With --bench, also convert a generated JPEG of WxH pixels\n"
+	"                 with 444, 422, 420 (default) or gray chroma subsampling.\n"
+	"    --threads=N  Decode each image on N threads, in bands if it has restart markers.\n"
 	"-v, --verbose    Verbose output.\n"
-	"    --width=N    Set output width, calculate height from ratio.\n\n"
+	"    --width=N    Set output width, calculate height from ratio.\n"
+	"    --widths=N,N,...  Print each file at each of these widths (at most 8), from a single decode.\n\n"
 
 	"  The default running mode is 'jtoa --width=78'\n", stderr);
 }
+// define some shorthand defines
+#define IF_OPTS(shortopt, longopt) if ( !strcmp(s, shortopt) || !strcmp(s, longopt) )
+#define IF_OPT(shortopt) if ( !strcmp(s, shortopt) )
+#define IF_VARS(format, var1, var2) if ( sscanf(s, format, var1, var2) == 2 )
+#define IF_VAR(format, var) if ( sscanf(s, format, var) == 1 )
+
+// Apply an option that changes the conversion to ctx.  Returns 0 if s is
+// one, -1 if it is not, and 1 with ctx->error set for an invalid value.
+int parse_conversion_option(jtoa_ctx *ctx, const char *s) {
+	IF_OPTS("-v", "--verbose")	{ ctx->verbose = 1; return 0; }
+	IF_OPTS("-i", "--invert") 	{ ctx->invert = 1; return 0; }
+	IF_OPT("--flipx") 		{ ctx->flipx = 1; return 0; }
+	IF_OPT("--flipy") 		{ ctx->flipy = 1; return 0; }
+	IF_OPT("--dct-scale")		{ ctx->dct_scale = 1; return 0; }
+	IF_OPT("--fast")		{ ctx->fast_sampling = 1; return 0; }
+	IF_OPT("--filter=nearest")	{ ctx->box_filter = 0; return 0; }
+	IF_OPT("--filter=box")		{ ctx->box_filter = 1; return 0; }
+	IF_OPT("--simd=auto")		{ ctx->simd = JTOA_SIMD_AUTO; return 0; }
+	IF_OPT("--simd=scalar")		{ ctx->simd = JTOA_SIMD_SCALAR; return 0; }
+	IF_OPT("--simd=sse2")		{ ctx->simd = JTOA_SIMD_SSE2; return 0; }
+	IF_OPT("--simd=avx2")		{ ctx->simd = JTOA_SIMD_AVX2; return 0; }
+	IF_OPT("--simd=neon")		{ ctx->simd = JTOA_SIMD_NEON; return 0; }
+	IF_OPT("--color=none")		{ ctx->color = JTOA_COLOR_NONE; return 0; }
+	IF_OPT("--color=truecolor")	{ ctx->color = JTOA_COLOR_TRUECOLOR; return 0; }
+	IF_OPT("--color=256")		{ ctx->color = JTOA_COLOR_256; return 0; }
+	IF_OPT("--color=16")		{ ctx->color = JTOA_COLOR_16; return 0; }
+	IF_OPT("--dither=none")		{ ctx->dither = JTOA_DITHER_NONE; return 0; }
+	IF_OPT("--dither=bayer")	{ ctx->dither = JTOA_DITHER_BAYER; return 0; }
+	IF_OPT("--dither=floyd")	{ ctx->dither = JTOA_DITHER_FLOYD; return 0; }
+	IF_OPT("--glyphs=ascii")	{ ctx->glyphs = JTOA_GLYPHS_ASCII; return 0; }
+	IF_OPT("--glyphs=halfblock")	{ ctx->glyphs = JTOA_GLYPHS_HALFBLOCK; return 0; }
+	IF_OPT("--glyphs=quadrant")	{ ctx->glyphs = JTOA_GLYPHS_QUADRANT; return 0; }
+	IF_OPT("--glyphs=braille")	{ ctx->glyphs = JTOA_GLYPHS_BRAILLE; return 0; }
+	IF_OPT("--luma=rec601")		{ ctx->luma_average = 0; return 0; }
+	IF_OPT("--luma=average")	{ ctx->luma_average = 1; return 0; }
+	IF_VAR("--width=%d", &ctx->width)	{ ctx->auto_height += 1; return 0; }
+	IF_VAR("--height=%d", &ctx->height)	{ ctx->auto_width += 1; return 0; }
+	IF_VAR("--rows=%d", &ctx->batch_rows)	{ return 0; }
+	IF_VAR("--threads=%d", &ctx->threads)	{ return 0; }
+	IF_OPT("--preview")		{ ctx->preview_scans = 1; return 0; }
+	IF_VAR("--preview=%d", &ctx->preview_scans)	{ return 0; }
+	if ( sscanf(s, "--crop=%d,%d,%dx%d", &ctx->crop_x, &ctx->crop_y,
+		&ctx->crop_width, &ctx->crop_height) == 4 )
+	{
+		ctx->crop = 1; return 0;
+	}
+	IF_VARS("--size=%dx%d", &ctx->width, &ctx->height) {
+		ctx->auto_width = ctx->auto_height = 0; return 0;
+	}
+
+	if ( !strncmp(s, "--chars=", 8) ) {
+		if ( strlen(s+8) > JTOA_PALETTE_SIZE ) {
+			snprintf(ctx->error, JTOA_ERROR_SIZE, "Too many ascii characters specified.");
+			return 1;
+		}
+		// don't use sscanf, we need to read spaces as well
+		strcpy(ctx->ascii_palette, s+8);
+		return 0;
+	}
+	return -1;
+}
+
+// Resolve the combination of size options, after parsing all of them
+void finish_conversion_options(jtoa_ctx *ctx) {
+	// only --width specified, calc width
+	if ( ctx->auto_width==1 && ctx->auto_height == 1 )
+		ctx->auto_height = 0;
+	// --width and --height is the same as using --size
+	if ( ctx->auto_width==2 && ctx->auto_height==1 )
+		ctx->auto_width = ctx->auto_height = 0;
+}
+
 // returns positive error code, or -1 for parsing OK
 int parse_options(const int argc, char** argv) {
+	int n, files;
 
-	// define some shorthand defines
-	#define IF_OPTS(shortopt, longopt) if ( !strcmp(s, shortopt) || !strcmp(s, longopt) )
-	#define IF_OPT(shortopt) if ( !strcmp(s, shortopt) )
-	#define IF_VARS(format, var1, var2) if ( sscanf(s, format, var1, var2) == 2 )
-	#define IF_VAR(format, var) if ( sscanf(s, format, var) == 1 )
+	if ( (file_names = (const char**) malloc(argc * sizeof(char*))) == NULL ||
+	     (conversion_args = (const char**) malloc(argc * sizeof(char*))) == NULL )
+	{
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
 
-	int n, files;
 	for ( n=1, files=0; n<argc; ++n ) {
 		const char *s = argv[n];
 
-		if ( *s != '-' ) { // count files to read
-			++files; continue;
+		if ( *s != '-' ) { // collect files to read
+			file_names[files++] = s; continue;
 		}
 
-		IF_OPT("-")			{ ++files; continue; }
-		IF_OPTS("-h", "--help")		{ help(); return 0; }
-		IF_OPTS("-v", "--verbose")	{ verbose = 1; continue; }
-		IF_OPTS("-i", "--invert") 	{ invert = 1; continue; }
-		IF_OPT("--flipx") 		{ flipx = 1; continue; }
-		IF_OPT("--flipy") 		{ flipy = 1; continue; }
-		IF_VAR("--width=%d", &width)	{ auto_height += 1; continue; }
-		IF_VAR("--height=%d", &height)	{ auto_width += 1; continue; }
-		IF_VARS("--size=%dx%d", &width, &height) { auto_width = auto_height = 0; continue; }
-
-		if ( !strncmp(s, "--chars=", 8) ) {
-			if ( strlen(s-8) > ASCII_PALETTE_SIZE ) {
-				fprintf(stderr, "Too many ascii characters specified.\n");
+		IF_OPT("-")			{ file_names[files++] = s; continue; }
+		IF_OPT("-j") {
+			if ( n+1 < argc && sscanf(argv[n+1], "%d", &jobs) == 1 ) { ++n; continue; }
+			fprintf(stderr, "Option -j requires a number of jobs.\n");
+			return 1;
+		}
+		IF_VAR("--jobs=%d", &jobs)	{ continue; }
+		IF_OPT("--mmap")		{ use_mmap = 1; continue; }
+		IF_OPT("--stream")		{ stream = 1; continue; }
+		IF_OPT("--info")		{ info = 1; continue; }
+		IF_OPTS("--stats", "--stats=text")	{ stats = STATS_TEXT; continue; }
+		IF_OPT("--stats=json")		{ stats = STATS_JSON; continue; }
+		IF_OPT("--bench")		{ bench_runs = 10; continue; }
+		IF_VAR("--bench=%d", &bench_runs)	{ continue; }
+		if ( !strncmp(s, "--synthetic=", 12) )	{ synthetic = s + 12; continue; }
+		if ( !strncmp(s, "--cache=", 8) )	{ cache_dir = s + 8; continue; }
+		IF_VAR("--cache-size=%ld", &cache_size)	{ continue; }
+		IF_VAR("--fps=%lf", &max_fps)	{ continue; }
+		if ( !strncmp(s, "--serve=", 8) )	{ serve_path = s + 8; continue; }
+		if ( !strncmp(s, "--widths=", 9) ) {
+			const char *w = s + 9;
+			int len;
+			for ( width_count = 0; width_count < JTOA_MAX_WIDTHS &&
+				sscanf(w, "%d%n", &widths[width_count], &len) == 1; ++width_count )
+			{
+				w += len;
+				if ( *w != ',' ) { ++width_count; break; }
+				++w;
+			}
+			if ( *w || width_count == 0 ) {
+				fprintf(stderr, "Invalid list of widths %s\n", s + 9);
 				return 1;
 			}
-			// don't use sscanf, we need to read spaces as well
-			strcpy(ascii_palette, s+8);
 			continue;
 		}
+		IF_OPTS("-h", "--help")		{ help(); return 0; }
+
+		const int r = parse_conversion_option(&options, s);
+		if ( r == 0 ) {
+			conversion_args[conversion_count++] = s;
+			continue;
+		}
+		if ( r > 0 ) {
+			fprintf(stderr, "%s\n", options.error);
+			return 1;
+		}
 		fprintf(stderr, "Unknown option %s\n\n", s);
 		help();
 		return 1;
 
 	} // args ...
-	if ( !files ) {
+	file_count = files;
+	if ( (stream || serve_path) && files ) {
+		fprintf(stderr, "--stream and --serve take no files.\n");
+		return 1;
+	}
+	if ( width_count && (stream || serve_path || info) ) {
+		fprintf(stderr, "--widths can only be used when converting files.\n");
+		return 1;
+	}
+	if ( stats && (stream || serve_path || info || bench_runs) ) {
+		fprintf(stderr, "--stats can only be used when converting files.\n");
+		return 1;
+	}
+	if ( bench_runs && (stream || serve_path || info || width_count || cache_dir) ) {
+		fprintf(stderr, "--bench can't be combined with --stream, --serve, --info, --widths or --cache.\n");
+		return 1;
+	}
+	if ( bench_runs < 0 ) {
+		fprintf(stderr, "Invalid number of benchmark runs specified.\n");
+		return 1;
+	}
+	if ( synthetic && !bench_runs ) {
+		fprintf(stderr, "--synthetic requires --bench.\n");
+		return 1;
+	}
+	if ( !files && !stream && !serve_path && !synthetic ) {
 		fprintf(stderr, "No files specified.\n\n");
 		help();
 		return 1;
 	}
-	// only --width specified, calc width
-	if ( auto_width==1 && auto_height == 1 )
-		auto_height = 0;
-	// --width and --height is the same as using --size
-	if ( auto_width==2 && auto_height==1 )
-		auto_width = auto_height = 0;
+	finish_conversion_options(&options);
 
-	if ( strlen(ascii_palette) < 2 ) {
-		fprintf(stderr, "You must specify at least two characters in --chars.\n");
+	if ( max_fps < 0 ) {
+		fprintf(stderr, "Invalid frame rate specified.\n");
+		return 1;
+	}
+	if ( cache_size < 1 ) {
+		fprintf(stderr, "Invalid cache size specified.\n");
+		return 1;
+	}
+	if ( cache_dir && mkdir(cache_dir, 0777) != 0 && errno != EEXIST ) {
+		fprintf(stderr, "Can't create cache directory %s\n", cache_dir);
 		return 1;
 	}
-	if ( (width < 1 && !auto_width) || (height < 1 && !auto_height) ) {
-		fprintf(stderr, "Invalid width or height specified.\n");
+	if ( jobs < 0 ) {
+		fprintf(stderr, "Invalid number of jobs specified.\n");
+		return 1;
+	}
+	if ( jobs == 0 ) {
+		// a server uses all processors by default
+		const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = serve_path && cpus > 0 ? (int) cpus : 1;
+	}
+	if ( jtoa_prepare(&options) ) {
+		fprintf(stderr, "%s\n", options.error);
 		return 1;
 	}
 	return -1;
 }
 
-void calc_aspect_ratio(const int jpeg_width, const int jpeg_height) {
-	// Calculate width or height, but not both
-	if ( auto_width && !auto_height ) {
-		width = ROUND(2.0f * (float) height * (float) jpeg_width / (float) jpeg_height);
-		// adjust for too small dimensions
-		while ( width==0 ) {
-			++height;
-			calc_aspect_ratio(jpeg_width, jpeg_height);
-		}
+// Memory map a regular file.  Returns nonzero if the file can't be mapped,
+// e.g. because it is a pipe.
+int map_file(const char *name, void **data, size_t *size) {
+	struct stat st;
+	int fd;
+
+	if ( (fd = open(name, O_RDONLY)) < 0 )
+		return 1;
+	if ( fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ) {
+		close(fd);
+		return 1;
 	}
-	if ( !auto_width && auto_height ) {
-		height = ROUND(0.5f * (float) width * (float) jpeg_height / (float) jpeg_width);
-		// adjust for too small dimensions
-		while ( height==0 ) {
-			++width;
-			calc_aspect_ratio(jpeg_width, jpeg_height);
+
+	*data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ( *data == MAP_FAILED )
+		return 1;
+	madvise(*data, st.st_size, MADV_SEQUENTIAL);
+	*size = st.st_size;
+	return 0;
+}
+
+// Read all of fp into a malloced buffer.  Returns nonzero on errors, when
+// *data is NULL and nothing needs to be freed.
+int read_all(FILE *fp, void **data, size_t *size) {
+	unsigned char *buf = NULL;
+	size_t capacity = 0;
+
+	if ( jtoa_read_file(fp, &buf, &capacity, size) ) {
+		free(buf);
+		*data = NULL;
+		return 1;
+	}
+	*data = buf;
+	return 0;
+}
+
+// Counters and times of one file for --stats
+typedef struct FileStats_ {
+	jtoa_stats lib;
+	jtoa_timings time;
+	size_t bytes_read;
+	size_t bytes_written;
+	int cached;
+	// seconds to convert, including reading, and to write the frame
+	double convert;
+	double output;
+} FileStats;
+
+// Write s as a JSON string
+static void json_string(FILE *fp, const char *s) {
+	fputc('"', fp);
+	for ( ; *s; ++s ) {
+		const unsigned char c = *s;
+		if ( c == '"' || c == '\\' )
+			fprintf(fp, "\\%c", c);
+		else if ( c < 0x20 )
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+// Print the --stats record of a converted file to stderr in one write, so
+// that records of parallel jobs don't interleave
+void print_stats(const char *name, const FileStats *fs) {
+	const jtoa_stats *s = &fs->lib;
+	const jtoa_timings *t = &fs->time;
+	const double mp = (double) s->decoded_width * s->scanlines_decoded * 1e-6;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp = open_memstream(&buf, &len);
+
+	if ( fp == NULL )
+		return;
+	if ( stats == STATS_JSON ) {
+		fputs("{\"file\": ", fp);
+		json_string(fp, name);
+		fprintf(fp, ", \"cached\": %s, \"bytes_read\": %lu, ", fs->cached ? "true" : "false",
+			(unsigned long) fs->bytes_read);
+		// nothing was decoded or rendered for a cache hit
+		if ( fs->cached )
+			fputs("\"source_width\": null, \"source_height\": null, \"dct_scale\": null, "
+				"\"decoded_width\": null, \"decoded_height\": null, \"source_mp_decoded\": null, "
+				"\"scanlines_decoded\": null, \"scanlines_skipped\": null, \"output_cells\": null, ", fp);
+		else
+			fprintf(fp, "\"source_width\": %d, \"source_height\": %d, \"dct_scale\": \"%d/%d\", "
+				"\"decoded_width\": %d, \"decoded_height\": %d, \"source_mp_decoded\": %.3f, "
+				"\"scanlines_decoded\": %d, \"scanlines_skipped\": %d, \"output_cells\": %ld, ",
+				s->source_width, s->source_height, s->scale_num, s->scale_denom, s->decoded_width,
+				s->decoded_height, mp, s->scanlines_decoded, s->scanlines_skipped, s->cells);
+		fprintf(fp, "\"bytes_written\": %lu, \"ms\": {\"header\": %.3f, \"decode\": %.3f, "
+			"\"accumulate\": %.3f, \"render\": %.3f, \"output\": %.3f, \"total\": %.3f}}\n",
+			(unsigned long) fs->bytes_written, t->header * 1e3, t->decode * 1e3, t->accumulate * 1e3,
+			t->render * 1e3, fs->output * 1e3, (fs->convert + fs->output) * 1e3);
+	} else {
+		fprintf(fp, "File: %s\n", name);
+		fprintf(fp, "Bytes read: %lu\n", (unsigned long) fs->bytes_read);
+		if ( fs->cached ) {
+			fprintf(fp, "Cache hit, not decoded\n");
+		} else {
+			fprintf(fp, "DCT scale: %d/%d (decoded %dx%d)\n", s->scale_num, s->scale_denom,
+				s->decoded_width, s->decoded_height);
+			fprintf(fp, "Source MP decoded: %.3f\n", mp);
+			fprintf(fp, "Scanlines decoded: %d, skipped: %d\n", s->scanlines_decoded, s->scanlines_skipped);
+			fprintf(fp, "Output cells: %ld\n", s->cells);
 		}
+		fprintf(fp, "Bytes written: %lu\n", (unsigned long) fs->bytes_written);
+		fprintf(fp, "Time (ms): header %.3f, decode %.3f, accumulate %.3f, render %.3f, output %.3f, total %.3f\n\n",
+			t->header * 1e3, t->decode * 1e3, t->accumulate * 1e3, t->render * 1e3, fs->output * 1e3,
+			(fs->convert + fs->output) * 1e3);
 	}
+	fclose(fp);
+	fwrite(buf, 1, len, stderr);
+	free(buf);
 }
 
-void print_image(const Image* i, const int chars) {
-	int x, y;
-	const int w = i->width;
-	const int h = i->height;
-	char line[w + 1];
-	line[w] = 0;
+// Join the frames of --widths into frame, and free them
+static int join_frames(char **frames, const size_t *sizes, char **frame, size_t *size) {
+	int n;
 
-	for ( y=0; y < h; ++y ) {
-		for ( x=0; x < w; ++x ) {
-			float intensity = i->pixel[(!flipy? y : h-y-1)*w + x];
-			int pos = ROUND( (float) chars * intensity );
-			line[!flipx? x : w-x-1] = ascii_palette[ !invert ? chars - pos : pos ];
+	*size = 0;
+	for ( n=0; n < width_count; ++n )
+		*size += sizes[n];
+	if ( (*frame = (char*) malloc(*size)) != NULL ) {
+		char *p = *frame;
+		for ( n=0; n < width_count; ++n ) {
+			memcpy(p, frames[n], sizes[n]);
+			p += sizes[n];
 		}
+	}
+	for ( n=0; n < width_count; ++n )
+		free(frames[n]);
+	return *frame == NULL;
+}
+
+// jtoa_render, or jtoa_render_widths with --widths
+int render_file(jtoa_ctx *ctx, FILE *fp, char **frame, size_t *size) {
+	char *frames[JTOA_MAX_WIDTHS];
+	size_t sizes[JTOA_MAX_WIDTHS];
+	int r;
 
-		printf("%s\n", line);
+	if ( !width_count )
+		return jtoa_render(ctx, fp, frame, size);
+	if ( (r = jtoa_render_widths(ctx, fp, widths, width_count, frames, sizes)) != 0 )
+		return r;
+	if ( join_frames(frames, sizes, frame, size) ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Not enough memory");
+		return 1;
 	}
+	return 0;
 }
 
-void clear(Image* i) {
-	memset(i->pixel, 0, i->width * i->height * sizeof(float));
-	memset(i->yadds, 0, i->height * sizeof(int) );
+// jtoa_render_buffer, or jtoa_render_widths_buffer with --widths
+int render_buffer(jtoa_ctx *ctx, const void *data, const size_t data_size, char **frame, size_t *size) {
+	char *frames[JTOA_MAX_WIDTHS];
+	size_t sizes[JTOA_MAX_WIDTHS];
+	int r;
+
+	if ( !width_count )
+		return jtoa_render_buffer(ctx, data, data_size, frame, size);
+	if ( (r = jtoa_render_widths_buffer(ctx, data, data_size, widths, width_count, frames, sizes)) != 0 )
+		return r;
+	if ( join_frames(frames, sizes, frame, size) ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Not enough memory");
+		return 1;
+	}
+	return 0;
 }
 
-void normalize(Image* i) {
-	const int w = i->width;
-	const int h = i->height;
+// Convert a memory mapped regular file.  Returns -1 if the file can't be
+// mapped, so the caller can fall back to stdio.
+int convert_mapped(jtoa_ctx *ctx, const char *name, char **frame, size_t *size, FileStats *fs) {
+	void *data;
+	size_t data_size;
+	int r;
+
+	if ( map_file(name, &data, &data_size) )
+		return -1;
+	if ( fs )
+		fs->bytes_read = data_size;
+
+	if (ctx->verbose)
+		fprintf(stderr, "File: %s\n", name);
+	if ( (r = render_buffer(ctx, data, data_size, frame, size)) != 0 )
+		fprintf(stderr, "%s: %s\n", name, ctx->error);
+
+	munmap(data, data_size);
+	return r;
+}
 
-	register int x, y, yoffs;
+// Convert through the render cache, which hashes the whole file
+int convert_cached(jtoa_ctx *ctx, const char *name, char **frame, size_t *size, FileStats *fs) {
+	char key[CACHE_KEY_SIZE];
+	void *data;
+	size_t data_size;
+	int mapped = 0, r;
 
-	for ( y=0, yoffs=0; y < h; ++y, yoffs += w )
-	for ( x=0; x < w; ++x ) {
-		if ( i->yadds[y] != 0 )
-			i->pixel[yoffs + x] /= (float) i->yadds[y];
+	if ( strcmp(name, "-") && !map_file(name, &data, &data_size) ) {
+		mapped = 1;
+	} else {
+		FILE *fp = strcmp(name, "-") ? fopen(name, "rb") : stdin;
+		if ( fp == NULL ) {
+			fprintf(stderr, "Can't open %s\n", name);
+			return 1;
+		}
+		r = read_all(fp, &data, &data_size);
+		if ( fp != stdin )
+			fclose(fp);
+		if ( r ) {
+			fprintf(stderr, "Can't read %s\n", name);
+			return 1;
+		}
+	}
+	if ( fs )
+		fs->bytes_read = data_size;
+
+	if (ctx->verbose)
+		fprintf(stderr, "File: %s\n", name);
+
+	cache_key(ctx, widths, width_count, data, data_size, key);
+	if ( cache_load(cache_dir, key, frame, size) == 0 ) {
+		if (ctx->verbose)
+			fprintf(stderr, "Cache hit: %s\n", key);
+		if ( fs )
+			fs->cached = 1;
+		r = 0;
+	} else if ( (r = render_buffer(ctx, data, data_size, frame, size)) != 0 ) {
+		fprintf(stderr, "%s: %s\n", name, ctx->error);
+	} else if ( cache_store(cache_dir, key, *frame, *size, (size_t) cache_size << 20) && ctx->verbose ) {
+		fprintf(stderr, "Can't store %s in cache %s\n", key, cache_dir);
+	}
+
+	if ( mapped )
+		munmap(data, data_size);
+	else
+		free(data);
+	return r;
+}
+
+// Convert one file argument ("-" for stdin) into a malloced frame
+static int convert_source(jtoa_ctx *ctx, const char *name, char **frame, size_t *size, FileStats *fs) {
+	FILE *fp = stdin;
+	int r;
+
+	if ( cache_dir )
+		return convert_cached(ctx, name, frame, size, fs);
+
+	// bands need the whole file in memory
+	if ( (use_mmap || ctx->threads > 1) && strcmp(name, "-") && (r = convert_mapped(ctx, name, frame, size, fs)) >= 0 )
+		return r;
+
+	if ( strcmp(name, "-") ) {
+		if ((fp = fopen(name, "rb")) == NULL) {
+			fprintf(stderr, "Can't open %s\n", name);
+			return 1;
+		}
+		if (ctx->verbose)
+			fprintf(stderr, "File: %s\n", name);
+	}
+	if ( (r = render_file(ctx, fp, frame, size)) != 0 )
+		fprintf(stderr, "%s: %s\n", name, ctx->error);
+	// libjpeg reads ahead in blocks, up to the end of small files
+	if ( fs ) {
+		const long pos = ftell(fp);
+		fs->bytes_read = pos > 0 ? pos : 0;
 	}
+
+	if ( fp != stdin )
+		fclose(fp);
+	return r;
+}
+
+// convert_source, and with fs collect its counters and times for --stats
+int convert_file(jtoa_ctx *ctx, const char *name, char **frame, size_t *size, FileStats *fs) {
+	if ( !fs )
+		return convert_source(ctx, name, frame, size, NULL);
+
+	memset(fs, 0, sizeof(FileStats));
+	ctx->stats = &fs->lib;
+	ctx->timings = &fs->time;
+	const double start = jtoa_now();
+	const int r = convert_source(ctx, name, frame, size, fs);
+	fs->convert = jtoa_now() - start;
+	if ( r == 0 )
+		fs->bytes_written = *size;
+	ctx->stats = NULL;
+	ctx->timings = NULL;
+	return r;
 }
 
-static float intensity(const JSAMPLE* source, const int components) {
-	float v = source[0];
+// Print the header information of one file argument ("-" for stdin)
+int print_file_info(jtoa_ctx *ctx, const char *name) {
+	FILE *fp = stdin;
+	jtoa_info i;
+	int r;
 
-	int c=1;
-	while ( c < components )
-		v += source[c++];
+	if ( strcmp(name, "-") && (fp = fopen(name, "rb")) == NULL ) {
+		fprintf(stderr, "Can't open %s\n", name);
+		return 1;
+	}
+	if ( (r = jtoa_read_info(ctx, fp, &i)) != 0 )
+		fprintf(stderr, "%s: %s\n", name, ctx->error);
+	else
+		printf("%s: source %dx%d, %d components%s, output %dx%d\n", name, i.source_width,
+			i.source_height, i.components, i.progressive ? ", progressive" : "", i.width, i.height);
 
-	v /= 255.0f * components;
-	return v;
+	if ( fp != stdin )
+		fclose(fp);
+	return r;
 }
 
-void print_info(const struct jpeg_decompress_struct* cinfo) {
-	fprintf(stderr, "Source width: %d\n", cinfo->output_width);
-	fprintf(stderr, "Source height: %d\n", cinfo->output_height);
-	fprintf(stderr, "Source color components: %d\n", cinfo->output_components);
-	fprintf(stderr, "Output width: %d\n", width);
-	fprintf(stderr, "Output height: %d\n", height);
-	fprintf(stderr, "Output palette (%d chars): '%s'\n\n", (int) strlen(ascii_palette), ascii_palette);
+// Write a rendered frame to stdout at once
+void print_frame(const char *frame, const size_t size) {
+	fwrite(frame, 1, size, stdout);
+	fflush(stdout);
 }
 
-static void process_scanline(const struct jpeg_decompress_struct *jpg, const JSAMPLE* scanline, Image* i) {
-	static int lasty = 0;
-	const int y = ROUND( i->resize_y * (float) (jpg->output_scanline-1) );
-	// include all scanlines since last call
-	while ( lasty <= y ) {
-		const int yoff = lasty * i->width;
-		int x;
+// A file handed to the worker pool, and its result
+typedef struct Job_ {
+	char *frame;
+	size_t size;
+	FileStats stats;
+	int status;
+	int done;
+} Job;
+
+typedef struct Pool_ {
+	Job *jobs;
+	int next;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+} Pool;
+
+static void* worker(void *arg) {
+	Pool *pool = (Pool*) arg;
+	// each thread converts with its own context
+	jtoa_ctx ctx;
+	jtoa_copy(&ctx, &options);
+
+	for ( ;; ) {
+		pthread_mutex_lock(&pool->lock);
+		const int n = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
 
-		for ( x=0; x < i->width; ++x ) {
-			i->pixel[yoff + x] += intensity( &scanline[ i->lookup_resx[x] ],
-				jpg->out_color_components);
+		if ( n >= file_count ) {
+			jtoa_free(&ctx);
+			return NULL;
 		}
 
-		++i->yadds[lasty++];
+		Job *job = &pool->jobs[n];
+		const int r = convert_file(&ctx, file_names[n], &job->frame, &job->size,
+			stats ? &job->stats : NULL);
+
+		pthread_mutex_lock(&pool->lock);
+		job->status = r;
+		job->done = 1;
+		pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
 	}
-	lasty = y;
 }
 
-void free_image(Image* i) {
-	if ( i->pixel ) free(i->pixel);
-	if ( i->yadds ) free(i->yadds);
-	if ( i->lookup_resx ) free(i->lookup_resx);
+// Convert files on a pool of threads, and print them in argument order
+// as soon as each one and all before it are done
+int convert_parallel(const int threads) {
+	Pool pool;
+	pthread_t *tid;
+	int n, started;
+
+	if ( (pool.jobs = (Job*) calloc(file_count, sizeof(Job))) == NULL ||
+	     (tid = (pthread_t*) malloc(threads * sizeof(pthread_t))) == NULL )
+	{
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
+	for ( started=0; started < threads; ++started )
+		if ( pthread_create(&tid[started], NULL, worker, &pool) != 0 )
+			break;
+
+	if ( !started ) {
+		fprintf(stderr, "Can't create worker threads\n");
+		return 1;
+	}
+
+	for ( n=0; n < file_count; ++n ) {
+		Job *job = &pool.jobs[n];
+
+		pthread_mutex_lock(&pool.lock);
+		while ( !job->done )
+			pthread_cond_wait(&pool.done, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+
+		// workers may still be running, exiting from main stops them
+		if ( job->status != 0 )
+			return job->status;
+
+		const double start = jtoa_now();
+		print_frame(job->frame, job->size);
+		free(job->frame);
+		if ( stats ) {
+			job->stats.output = jtoa_now() - start;
+			print_stats(file_names[n], &job->stats);
+		}
+	}
+
+	for ( n=0; n < started; ++n )
+		pthread_join(tid[n], NULL);
+
+	free(tid);
+	free(pool.jobs);
+	return 0;
 }
 
-void malloc_image(Image* i) {
-	i->pixel = NULL;
-	i->yadds = NULL;
-	i->lookup_resx = NULL;
+// Frames larger than this are discarded by --stream
+#define MAX_STREAM_FRAME (64 << 20)
+#define STREAM_INCOMPLETE 0
+#define STREAM_INVALID ((size_t) -1)
+
+// Where jpeg_length stopped in an incomplete JPEG, relative to its SOI
+// marker, so that it resumes there once more data arrived rather than
+// walking the frame from its start again
+typedef struct JpegWalk_ {
+	size_t pos;
+	// in the entropy coded data after an SOS marker
+	int in_scan;
+} JpegWalk;
+
+#define JPEG_WALK_START { 2, 0 }
+
+// Length of the JPEG starting with the SOI marker at data, STREAM_INCOMPLETE
+// if more data is needed, or STREAM_INVALID if it is malformed.  Walks the
+// marker segments rather than searching for EOI, which may also end an
+// embedded thumbnail.  Continues from and updates w.
+static size_t jpeg_length(const unsigned char *data, const size_t size, JpegWalk *w) {
+	size_t pos = w->pos;
+
+	for ( ;; ) {
+		if ( w->in_scan ) {
+			// entropy coded data up to the next marker
+			while ( pos + 1 < size && (data[pos] != 0xFF || data[pos+1] == 0 ||
+				(data[pos+1] >= 0xD0 && data[pos+1] <= 0xD7)) )
+				++pos;
+			if ( pos + 1 >= size ) {
+				w->pos = pos;
+				return STREAM_INCOMPLETE;
+			}
+			w->in_scan = 0;
+		}
+		w->pos = pos;
 
-	i->width = width;
-	i->height = height;
+		// skip fill bytes before the marker
+		while ( pos + 1 < size && data[pos] == 0xFF && data[pos+1] == 0xFF )
+			++pos;
+		if ( pos + 2 > size )
+			return STREAM_INCOMPLETE;
+		if ( data[pos] != 0xFF )
+			return STREAM_INVALID;
 
-	if ( (i->pixel = (float*) malloc(width * height * sizeof(float))) == NULL ) {
-		fprintf(stderr, "Not enough memory for given output dimension\n");
-		exit(1);
+		const int marker = data[pos+1];
+		if ( marker == 0xD9 ) // EOI
+			return pos + 2;
+		if ( marker == 0xD8 ) // SOI of the next frame, this one was truncated
+			return STREAM_INVALID;
+		if ( marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7) ) { // no length
+			pos += 2;
+			continue;
+		}
+		if ( pos + 4 > size )
+			return STREAM_INCOMPLETE;
+		pos += 2 + (data[pos+2] << 8 | data[pos+3]);
+		if ( marker == 0xDA ) // SOS
+			w->in_scan = 1;
 	}
+}
 
-	if ( (i->yadds = (int*) malloc(height * sizeof(int))) == NULL ) {
-		fprintf(stderr, "Not enough memory for given output dimension (for yadds)\n");
-		free_image(i);
-		exit(1);
+// Latest complete frame read from stdin by stream_reader, for the drawing
+// thread to pick up
+typedef struct Stream_ {
+	unsigned char *frame;
+	size_t size;
+	size_t capacity;
+	int pending;
+	int eof;
+	unsigned long dropped;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+} Stream;
+
+// Hand a frame over to the drawing thread, replacing a pending one that
+// it has not picked up yet
+static void stream_post(Stream *st, const unsigned char *data, const size_t size) {
+	pthread_mutex_lock(&st->lock);
+	if ( size > st->capacity ) {
+		unsigned char *frame = (unsigned char*) realloc(st->frame, size);
+		if ( frame == NULL ) {
+			pthread_mutex_unlock(&st->lock);
+			fprintf(stderr, "Not enough memory for stream frame\n");
+			return;
+		}
+		st->frame = frame;
+		st->capacity = size;
 	}
+	memcpy(st->frame, data, size);
+	st->size = size;
+	if ( st->pending )
+		++st->dropped;
+	st->pending = 1;
+	pthread_cond_signal(&st->ready);
+	pthread_mutex_unlock(&st->lock);
+}
+
+// Split stdin into JPEGs as fast as it arrives, so that a slow terminal
+// drops frames instead of letting the input queue up
+static void* stream_reader(void *arg) {
+	Stream *st = (Stream*) arg;
+	unsigned char *buf = NULL;
+	size_t size = 0, capacity = 0;
+	// the walk of the incomplete frame at buf, if resume is set
+	JpegWalk walk = JPEG_WALK_START;
+	int resume = 0;
 
-	if ( (i->lookup_resx = (int*) malloc(width * sizeof(int))) == NULL ) {
-		fprintf(stderr, "Not enough memory for given output dimension (lookup_resx)\n");
-		free_image(i);
-		exit(1);
+	for ( ;; ) {
+		// grow by doubling, so that large frames are copied O(log n) times
+		if ( capacity - size < 65536 ) {
+			const size_t grown_capacity = capacity ? 2 * capacity : 65536;
+			unsigned char *grown = (unsigned char*) realloc(buf, grown_capacity);
+			if ( grown == NULL ) {
+				fprintf(stderr, "Not enough memory for stream input\n");
+				break;
+			}
+			buf = grown;
+			capacity = grown_capacity;
+		}
+		const ssize_t n = read(STDIN_FILENO, buf + size, capacity - size);
+		if ( n <= 0 )
+			break;
+		size += n;
+
+		size_t start = 0;
+		while ( start < size ) {
+			// resynchronise on the next SOI marker
+			const unsigned char *soi = (const unsigned char*) memchr(buf + start, 0xFF, size - start);
+			if ( soi == NULL ) { start = size; break; }
+			start = soi - buf;
+			if ( start + 1 >= size ) break;
+			if ( buf[start+1] != 0xD8 ) { ++start; continue; }
+
+			if ( start != 0 || !resume ) {
+				const JpegWalk fresh = JPEG_WALK_START;
+				walk = fresh;
+			}
+			resume = 0;
+			const size_t len = jpeg_length(buf + start, size - start, &walk);
+			if ( len == STREAM_INVALID ) {
+				++start;
+				continue;
+			}
+			if ( len == STREAM_INCOMPLETE ) {
+				if ( size - start > MAX_STREAM_FRAME ) {
+					fprintf(stderr, "Discarding stream frame larger than %d bytes\n", MAX_STREAM_FRAME);
+					++start;
+					continue;
+				}
+				// the frame moves to buf, where the walk continues
+				resume = 1;
+				break;
+			}
+			stream_post(st, buf + start, len);
+			start += len;
+		}
+		if ( start ) {
+			memmove(buf, buf + start, size - start);
+			size -= start;
+		}
 	}
+	free(buf);
+
+	pthread_mutex_lock(&st->lock);
+	st->eof = 1;
+	pthread_cond_signal(&st->ready);
+	pthread_mutex_unlock(&st->lock);
+	return NULL;
 }
 
-void init_image(Image *i, const struct jpeg_decompress_struct *jpg) {
-	i->resize_y = (float) (i->height - 1) / (float) (jpg->output_height-1);
-	i->resize_x = (float) jpg->output_width / (float) i->width;
+static int write_all(const char *data, size_t size) {
+	while ( size > 0 ) {
+		const ssize_t n = write(STDOUT_FILENO, data, size);
+		if ( n < 0 )
+			return 1;
+		data += n;
+		size -= n;
+	}
+	return 0;
+}
 
-	int dst_x;
-	for ( dst_x=0; dst_x < i->width; ++dst_x ) {
-		i->lookup_resx[dst_x] = (int)( (float) dst_x * i->resize_x );
-		i->lookup_resx[dst_x] *= jpg->out_color_components;
+// Unchanged cells shorter than this between two changed ones are resent
+// rather than costing another cursor positioning escape
+#define DIFF_MIN_GAP 8
+// Redraw the whole frame when its difference would be larger than this
+// fraction of it
+#define DIFF_MAX_FRACTION 0.5
+#define DIFF_NONE ((size_t) -1)
+
+// Write the escapes and text that turn prev into frame, both size bytes of
+// lines of the same width, into out.  Returns their length, or DIFF_NONE
+// if that would exceed limit.
+static size_t frame_diff(const char *prev, const char *frame, const size_t size,
+	char *out, const size_t limit)
+{
+	const char *eol = (const char*) memchr(frame, '\n', size);
+	const int w = eol ? eol - frame : 0;
+	const int h = size / (w + 1);
+	size_t len = 0;
+	int x, y;
+
+	for ( y=0; y < h; ++y ) {
+		const char *a = prev + y * (w + 1), *b = frame + y * (w + 1);
+
+		for ( x=0; x < w; ++x ) {
+			if ( a[x] == b[x] )
+				continue;
+			// extend the run over short gaps of unchanged cells
+			int end = x + 1, scan;
+			for ( scan = end; scan < w && scan - end < DIFF_MIN_GAP; ++scan )
+				if ( a[scan] != b[scan] )
+					end = scan + 1;
+
+			char move[32];
+			const int n = snprintf(move, sizeof(move), "\033[%d;%dH", y + 1, x + 1);
+			if ( len + n + (end - x) > limit )
+				return DIFF_NONE;
+			memcpy(out + len, move, n);
+			memcpy(out + len + n, b + x, end - x);
+			len += n + (end - x);
+			x = end;
+		}
 	}
+	return len;
 }
 
-int decompress(FILE *fp) {
-	struct jpeg_error_mgr jerr;
-	struct jpeg_decompress_struct jpg;
+// Cursor home, and clear screen for the first frame or one that shrinks
+#define HOME "\033[H"
+#define CLEAR "\033[2J"
+#define HOME_LEN (sizeof(HOME) - 1)
 
-	jpg.err = jpeg_std_error(&jerr);
+// Draw the JPEGs read from stdin in place, at most max_fps per second
+int convert_stream() {
+	Stream st;
+	pthread_t reader;
+	unsigned char *data = NULL;
+	size_t data_capacity = 0;
+	char *out = NULL;
+	size_t out_capacity = 0;
+	// the last frame drawn, its size in cells, and the difference to the
+	// next one
+	char *prev = NULL, *diff = NULL;
+	int last_width = 0, last_height = 0;
+	// counts the cells of each frame, --stats is not used with --stream
+	jtoa_stats frame_stats;
+	unsigned long drawn = 0, written = 0;
+	double next = jtoa_now();
 
-	jpeg_create_decompress(&jpg);
-	jpeg_stdio_src(&jpg, fp);
-	jpeg_read_header(&jpg, TRUE);
-	jpeg_start_decompress(&jpg);
+	if ( (out = (char*) malloc(HOME_LEN)) == NULL ) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	out_capacity = HOME_LEN;
+	options.stats = &frame_stats;
 
-	int row_stride = jpg.output_width * jpg.output_components;
+	memset(&st, 0, sizeof(st));
+	pthread_mutex_init(&st.lock, NULL);
+	pthread_cond_init(&st.ready, NULL);
+	if ( pthread_create(&reader, NULL, stream_reader, &st) != 0 ) {
+		fprintf(stderr, "Can't create stream reader thread\n");
+		return 1;
+	}
 
-	JSAMPARRAY buffer = (*jpg.mem->alloc_sarray)
-		((j_common_ptr) &jpg, JPOOL_IMAGE, row_stride, 1);
+	for ( ;; ) {
+		pthread_mutex_lock(&st.lock);
+		while ( !st.pending && !st.eof )
+			pthread_cond_wait(&st.ready, &st.lock);
+		if ( !st.pending ) {
+			pthread_mutex_unlock(&st.lock);
+			break;
+		}
+		// take the frame by swapping buffers with the reader
+		unsigned char *frame = st.frame;
+		const size_t frame_size = st.size, frame_capacity = st.capacity;
+		st.frame = data;
+		st.capacity = data_capacity;
+		st.pending = 0;
+		pthread_mutex_unlock(&st.lock);
+		data = frame;
+		data_capacity = frame_capacity;
 
-	calc_aspect_ratio(jpg.output_width, jpg.output_height);
+		// the text goes after the cursor home sequence, the buffer grows
+		// when jtoa_render_mem reports it too small, before decoding
+		size_t size;
+		memset(&frame_stats, 0, sizeof(frame_stats));
+		int r = jtoa_render_mem(&options, data, frame_size, out + HOME_LEN,
+			out_capacity - HOME_LEN, &size);
+		if ( r == JTOA_BUFFER_TOO_SMALL ) {
+			char *grown = (char*) realloc(out, HOME_LEN + size);
+			if ( grown == NULL ) {
+				fprintf(stderr, "Not enough memory\n");
+				return 1;
+			}
+			out = grown;
+			out_capacity = HOME_LEN + size;
+			r = jtoa_render_mem(&options, data, frame_size, out + HOME_LEN, size, &size);
+		}
+		if ( r != 0 ) {
+			fprintf(stderr, "stdin: %s\n", options.error);
+			continue;
+		}
 
-	Image image;
-	malloc_image(&image);
-	clear(&image);
+		// every row ends in a newline, whatever the escapes and UTF-8
+		// chars before it
+		const char *text = out + HOME_LEN, *eol = text;
+		int width = 0, height = 0;
+		while ( (eol = (const char*) memchr(eol, '\n', text + size - eol)) != NULL ) {
+			++eol;
+			++height;
+		}
+		if ( height )
+			width = (int) (frame_stats.cells / height);
+		const int same = drawn && width == last_width && height == last_height;
 
-	if ( verbose ) print_info(&jpg);
+		// a smaller frame drawn whole would leave the old one's last rows
+		// or columns on screen
+		if ( (!drawn || width < last_width || height < last_height) && write_all(CLEAR, sizeof(CLEAR) - 1) )
+			return 1;
 
-	init_image(&image, &jpg);
+		// only send the changed cells of a frame of the same size.  The
+		// reader may still be running, exiting from main stops it.
+		size_t len = DIFF_NONE;
+		if ( options.color || options.glyphs ) {
+			// colored and UTF-8 frames vary in size and layout, so redraw
+			// them whole
+		} else if ( same ) {
+			len = frame_diff(prev, text, size, diff, (size_t) (size * DIFF_MAX_FRACTION));
+			if ( len != DIFF_NONE && write_all(diff, len) )
+				return 1;
+		} else if ( (prev = (char*) realloc(prev, size)) == NULL ||
+		            (diff = (char*) realloc(diff, size)) == NULL )
+		{
+			fprintf(stderr, "Not enough memory\n");
+			return 1;
+		}
+		last_width = width;
+		last_height = height;
+		if ( len == DIFF_NONE ) {
+			memcpy(out, HOME, HOME_LEN);
+			if ( write_all(out, HOME_LEN + size) )
+				return 1;
+			len = HOME_LEN + size;
+		}
+		if ( !options.color && !options.glyphs )
+			memcpy(prev, out + HOME_LEN, size);
+		written += len;
+		++drawn;
 
-	while (jpg.output_scanline < jpg.output_height) {
-		jpeg_read_scanlines(&jpg, buffer, 1);
-		process_scanline(&jpg, buffer[0], &image);
+		if ( max_fps > 0 ) {
+			// frames arriving while waiting are dropped by stream_post
+			next += 1.0 / max_fps;
+			const double wait = next - jtoa_now();
+			if ( wait > 0 ) {
+				struct timespec ts = { (time_t) wait, (long) ((wait - (time_t) wait) * 1e9) };
+				nanosleep(&ts, NULL);
+			} else {
+				next = jtoa_now();
+			}
+		}
 	}
-	normalize(&image);
 
-	print_image(&image, (int) strlen(ascii_palette) - 1);
+	pthread_join(reader, NULL);
+	if ( options.verbose )
+		fprintf(stderr, "Frames drawn: %lu, dropped: %lu, bytes written: %lu\n",
+			drawn, st.dropped, written);
+
+	free(st.frame);
+	free(data);
+	free(out);
+	free(prev);
+	free(diff);
+	jtoa_free(&options);
+	return 0;
+}
+
+// Requests and replies on a --serve connection start with a header of two
+// big endian 32 bit numbers.  A request has the size of its options and
+// the size of its JPEG, followed by the options as NUL terminated strings,
+// the same as on the command line, and then the JPEG.  A reply has a
+// status, 0 for success, and the size of its text, followed by the text or
+// an error message.  Replies come in request order, and clients may send
+// more requests before reading the replies to earlier ones.
+#define SERVE_MAX_OPTIONS 65536
+#define SERVE_MAX_JPEG (256 << 20)
+// requests read ahead from one connection before its replies are sent
+#define SERVE_MAX_INFLIGHT 64
+
+typedef struct Reply_ {
+	struct Reply_ *next;
+	char *text;
+	size_t size;
+	int status;
+	int done;
+} Reply;
 
-	free_image(&image);
+// A client connection.  Its reader queues requests and their replies, and
+// its writer sends the replies in order as the workers finish them.
+typedef struct Conn_ {
+	int fd;
+	pthread_t reader;
+	int has_reader;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	Reply *head;
+	Reply *tail;
+	int inflight;
+	int closed;
+} Conn;
 
-	jpeg_finish_decompress(&jpg);
-	jpeg_destroy_decompress(&jpg);
+typedef struct Request_ {
+	struct Request_ *next;
+	Conn *conn;
+	Reply *reply;
+	char *options;
+	size_t options_size;
+	unsigned char *data;
+	size_t size;
+} Request;
 
+// requests waiting for a worker, from all connections
+static Request *queue_head = NULL, *queue_tail = NULL;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+
+static uint32_t get_be32(const unsigned char *p) {
+	return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put_be32(unsigned char *p, const uint32_t v) {
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static int recv_all(const int fd, void *buf, size_t size) {
+	char *p = (char*) buf;
+	while ( size > 0 ) {
+		const ssize_t n = recv(fd, p, size, 0);
+		if ( n <= 0 )
+			return 1;
+		p += n;
+		size -= n;
+	}
 	return 0;
 }
 
-int main(int argc, char** argv) {
-	strcpy(ascii_palette, default_palette);
-	int r = parse_options(argc, argv);
-	if ( r >= 0 ) return r;
+static int send_all(const int fd, const void *buf, size_t size) {
+	const char *p = (const char*) buf;
+	while ( size > 0 ) {
+		const ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+		if ( n < 0 )
+			return 1;
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static void free_request(Request *req) {
+	free(req->options);
+	free(req->data);
+	free(req);
+}
+
+static Request* read_request(Conn *c) {
+	unsigned char header[8];
+	Request *req;
+
+	if ( recv_all(c->fd, header, sizeof(header)) )
+		return NULL;
+	const uint32_t options_size = get_be32(header), size = get_be32(header + 4);
+	if ( options_size > SERVE_MAX_OPTIONS || size > SERVE_MAX_JPEG )
+		return NULL;
+
+	if ( (req = (Request*) calloc(1, sizeof(Request))) == NULL )
+		return NULL;
+	// the options end in a NUL even if the client's don't
+	req->options = (char*) calloc(1, options_size + 1);
+	req->data = (unsigned char*) malloc(size ? size : 1);
+	req->reply = (Reply*) calloc(1, sizeof(Reply));
+	if ( req->options == NULL || req->data == NULL || req->reply == NULL ||
+	     recv_all(c->fd, req->options, options_size) || recv_all(c->fd, req->data, size) )
+	{
+		free(req->reply);
+		free_request(req);
+		return NULL;
+	}
+	req->conn = c;
+	req->options_size = options_size;
+	req->size = size;
+	return req;
+}
+
+static void* serve_reader(void *arg) {
+	Conn *c = (Conn*) arg;
+	Request *req;
+
+	while ( (req = read_request(c)) != NULL ) {
+		// keep the reply's place in the order of the connection
+		pthread_mutex_lock(&c->lock);
+		while ( c->inflight >= SERVE_MAX_INFLIGHT )
+			pthread_cond_wait(&c->changed, &c->lock);
+		if ( c->tail ) c->tail->next = req->reply; else c->head = req->reply;
+		c->tail = req->reply;
+		++c->inflight;
+		pthread_mutex_unlock(&c->lock);
+
+		pthread_mutex_lock(&queue_lock);
+		if ( queue_tail ) queue_tail->next = req; else queue_head = req;
+		queue_tail = req;
+		pthread_cond_signal(&queue_ready);
+		pthread_mutex_unlock(&queue_lock);
+	}
+
+	pthread_mutex_lock(&c->lock);
+	c->closed = 1;
+	pthread_cond_broadcast(&c->changed);
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+static void* serve_writer(void *arg) {
+	Conn *c = (Conn*) arg;
+	int failed = 0;
+
+	for ( ;; ) {
+		pthread_mutex_lock(&c->lock);
+		while ( !(c->head && c->head->done) && !(c->closed && !c->head) )
+			pthread_cond_wait(&c->changed, &c->lock);
+		Reply *reply = c->head;
+		if ( reply ) {
+			if ( (c->head = reply->next) == NULL ) c->tail = NULL;
+			--c->inflight;
+			pthread_cond_broadcast(&c->changed);
+		}
+		pthread_mutex_unlock(&c->lock);
+		if ( !reply )
+			break;
+
+		unsigned char header[8];
+		put_be32(header, reply->status);
+		put_be32(header + 4, reply->size);
+		// after a failed send, drop replies until the reader stops too
+		if ( !failed && (send_all(c->fd, header, sizeof(header)) ||
+		     send_all(c->fd, reply->text, reply->size)) )
+		{
+			failed = 1;
+			shutdown(c->fd, SHUT_RDWR);
+		}
+		free(reply->text);
+		free(reply);
+	}
+
+	if ( c->has_reader )
+		pthread_join(c->reader, NULL);
+	close(c->fd);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->changed);
+	free(c);
+	return NULL;
+}
+
+// Set up ctx with the server's options followed by those of a request,
+// keeping its decoder and buffers.  Returns 0 on success.
+static int setup_request(jtoa_ctx *ctx, const char *options, const size_t size) {
+	jtoa_state *state = ctx->state;
+	const char *s;
 	int n;
-	
-	for ( n=1; n<argc; ++n ) {
-		// Skip options
-		if ( argv[n][0]=='-' && argv[n][1]!=0 )
+
+	jtoa_init(ctx);
+	ctx->state = state;
+	for ( n=0; n < conversion_count; ++n )
+		parse_conversion_option(ctx, conversion_args[n]);
+
+	for ( s = options; s < options + size; s += strlen(s) + 1 ) {
+		if ( !*s )
 			continue;
-		// Read from stdin
-		if ( argv[n][0]=='-' && argv[n][1]==0 ) {
-			int r = decompress(stdin);
-			if ( r == 0 )
-				continue;
+		const int r = parse_conversion_option(ctx, s);
+		if ( r < 0 )
+			snprintf(ctx->error, JTOA_ERROR_SIZE, "Unknown option %s", s);
+		if ( r != 0 )
+			return 1;
+	}
+	finish_conversion_options(ctx);
+	return jtoa_prepare(ctx);
+}
+
+static void* serve_worker(void *arg) {
+	jtoa_ctx ctx;
+	// options of the last request, to skip setting up the same again
+	char *last = NULL;
+	size_t last_size = 0;
+
+	jtoa_init(&ctx);
+	for ( ;; ) {
+		pthread_mutex_lock(&queue_lock);
+		while ( !queue_head )
+			pthread_cond_wait(&queue_ready, &queue_lock);
+		Request *req = queue_head;
+		if ( (queue_head = req->next) == NULL ) queue_tail = NULL;
+		pthread_mutex_unlock(&queue_lock);
+
+		Reply *reply = req->reply;
+		int r = 0;
+		if ( !last || last_size != req->options_size || memcmp(last, req->options, last_size) ) {
+			free(last);
+			last = NULL;
+			if ( (r = setup_request(&ctx, req->options, req->options_size)) == 0 ) {
+				// take over the options, the request frees the new ones
+				last = req->options;
+				last_size = req->options_size;
+				req->options = NULL;
+			}
+		}
+		if ( r == 0 )
+			r = jtoa_render_buffer(&ctx, req->data, req->size, &reply->text, &reply->size);
+		if ( r != 0 ) {
+			reply->text = strdup(ctx.error);
+			reply->size = reply->text ? strlen(reply->text) : 0;
+		}
+		reply->status = r;
+
+		Conn *c = req->conn;
+		pthread_mutex_lock(&c->lock);
+		reply->done = 1;
+		pthread_cond_broadcast(&c->changed);
+		pthread_mutex_unlock(&c->lock);
+		free_request(req);
+	}
+	return NULL;
+}
+
+// Accept clients on a Unix socket at path until killed
+int serve(const char *path, const int threads) {
+	struct sockaddr_un addr;
+	struct stat st;
+	pthread_t tid;
+	int fd, n;
+
+	if ( strlen(path) >= sizeof(addr.sun_path) ) {
+		fprintf(stderr, "Socket path %s is too long\n", path);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	// replace the socket of an earlier server
+	if ( lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) )
+		unlink(path);
+
+	if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	     bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, 128) != 0 )
+	{
+		fprintf(stderr, "Can't listen on %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	for ( n=0; n < threads; ++n ) {
+		if ( pthread_create(&tid, NULL, serve_worker, NULL) != 0 ) {
+			fprintf(stderr, "Can't create worker threads\n");
+			return 1;
+		}
+		pthread_detach(tid);
+	}
+	if ( options.verbose )
+		fprintf(stderr, "Serving on %s with %d threads\n", path, threads);
+
+	for ( ;; ) {
+		const int client = accept(fd, NULL, NULL);
+		if ( client < 0 ) {
+			if ( errno != EINTR )
+				fprintf(stderr, "accept: %s\n", strerror(errno));
+			continue;
+		}
+
+		Conn *c = (Conn*) calloc(1, sizeof(Conn));
+		if ( c == NULL ) {
+			close(client);
+			continue;
+		}
+		c->fd = client;
+		pthread_mutex_init(&c->lock, NULL);
+		pthread_cond_init(&c->changed, NULL);
+		// the writer joins the reader and frees the connection
+		if ( pthread_create(&tid, NULL, serve_writer, c) != 0 ) {
+			close(client);
+			free(c);
+			continue;
+		}
+		pthread_detach(tid);
+		c->has_reader = 1;
+		if ( pthread_create(&c->reader, NULL, serve_reader, c) != 0 ) {
+			pthread_mutex_lock(&c->lock);
+			c->has_reader = 0;
+			c->closed = 1;
+			pthread_cond_broadcast(&c->changed);
+			pthread_mutex_unlock(&c->lock);
 		}
-		FILE *fp;
-		if ((fp = fopen(argv[n], "rb")) != NULL) {
-			if (verbose)
-				fprintf(stderr, "File: %s\n", argv[n]);
-			int r = decompress(fp);
+	}
+}
+
+// Load the files and the synthetic image into memory and benchmark them
+int run_bench() {
+	BenchInput *inputs = (BenchInput*) calloc(file_count + 1, sizeof(BenchInput));
+	int count = 0, r = 1, n;
+
+	if ( inputs == NULL ) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	for ( n=0; n < file_count; ++n ) {
+		const char *name = file_names[n];
+		FILE *fp = stdin;
+		void *data;
+		size_t size;
+
+		if ( strcmp(name, "-") && (fp = fopen(name, "rb")) == NULL ) {
+			fprintf(stderr, "Can't open %s\n", name);
+			goto done;
+		}
+		const int failed = read_all(fp, &data, &size);
+		if ( fp != stdin )
 			fclose(fp);
-			if (r != 0)
+		if ( failed ) {
+			fprintf(stderr, "Can't read %s\n", name);
+			goto done;
+		}
+		inputs[count].name = name;
+		inputs[count].data = data;
+		inputs[count++].size = size;
+	}
+	if ( synthetic ) {
+		unsigned char *data;
+		size_t size;
+		if ( bench_synthesize(synthetic, &data, &size) ) {
+			fprintf(stderr, "Invalid synthetic image %s\n", synthetic);
+			goto done;
+		}
+		inputs[count].name = synthetic;
+		inputs[count].data = data;
+		inputs[count++].size = size;
+	}
+
+	r = bench_run(&options, inputs, count, bench_runs);
+
+done:
+	for ( n=0; n < count; ++n )
+		free((void*) inputs[n].data);
+	free(inputs);
+	jtoa_free(&options);
+	return r;
+}
+
+int main(int argc, char** argv) {
+	jtoa_init(&options);
+	int r = parse_options(argc, argv);
+	if ( r >= 0 ) return r;
+
+	if ( stream )
+		return convert_stream();
+
+	if ( serve_path )
+		return serve(serve_path, jobs);
+
+	if ( bench_runs )
+		return run_bench();
+
+	if ( info ) {
+		int n;
+		for ( n=0; n < file_count; ++n )
+			if ( (r = print_file_info(&options, file_names[n])) != 0 )
 				return r;
-		} else {
-			fprintf(stderr, "Can't open %s\n", argv[n]);
-			return 1;
+		jtoa_free(&options);
+		return 0;
+	}
+
+	if ( jobs > 1 && file_count > 1 )
+		return convert_parallel(jobs < file_count ? jobs : file_count);
+
+	int n;
+	for ( n=0; n < file_count; ++n ) {
+		char *frame;
+		size_t size;
+		FileStats fs;
+		int r = convert_file(&options, file_names[n], &frame, &size, stats ? &fs : NULL);
+		if ( r != 0 )
+			return r;
+		const double start = jtoa_now();
+		print_frame(frame, size);
+		free(frame);
+		if ( stats ) {
+			fs.output = jtoa_now() - start;
+			print_stats(file_names[n], &fs);
 		}
 	}
+	jtoa_free(&options);
 	return 0;
 }
-
@@ -0,0 +1,226 @@
+#ifndef JTOA_H
+#define JTOA_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JTOA_PALETTE_SIZE 256
+#define JTOA_ERROR_SIZE 200 // at least libjpeg's JMSG_LENGTH_MAX
+
+// Normalised intensities are quantised to JTOA_LUT_BITS before the
+// palette lookup
+#define JTOA_LUT_BITS 12
+#define JTOA_LUT_SIZE (1 << JTOA_LUT_BITS)
+
+// Most widths jtoa_render_widths renders from one decode
+#define JTOA_MAX_WIDTHS 8
+
+// Return codes besides 0 for success
+#define JTOA_ERROR 1
+#define JTOA_BUFFER_TOO_SMALL 2
+
+// Instruction sets for the accumulation kernels
+#define JTOA_SIMD_AUTO 0
+#define JTOA_SIMD_SCALAR 1
+#define JTOA_SIMD_SSE2 2
+#define JTOA_SIMD_AVX2 3
+#define JTOA_SIMD_NEON 4
+
+// Output colors
+#define JTOA_COLOR_NONE 0
+#define JTOA_COLOR_TRUECOLOR 1
+#define JTOA_COLOR_256 2
+#define JTOA_COLOR_16 3
+
+// Dithering of the intensities before picking glyphs
+#define JTOA_DITHER_NONE 0
+#define JTOA_DITHER_BAYER 1 // 4x4 ordered
+#define JTOA_DITHER_FLOYD 2 // Floyd-Steinberg error diffusion
+
+// Glyphs drawing each cell, with the pixels per cell of the sub-cell modes
+#define JTOA_GLYPHS_ASCII 0
+#define JTOA_GLYPHS_HALFBLOCK 1 // 1x2
+#define JTOA_GLYPHS_QUADRANT 2 // 2x2
+#define JTOA_GLYPHS_BRAILLE 3 // 2x4
+
+#define JTOA_DEFAULT_PALETTE "   ...',;:clodxkO0KXNWM"
+
+// Seconds spent in each stage of the last conversion, see jtoa_ctx.timings
+typedef struct jtoa_timings_ {
+	// reading the header and setting up the decompressor and images
+	double header;
+	// decoding scanlines, including accumulation with --fast or threads
+	double decode;
+	// resampling scanlines and adding them into the output cells
+	double accumulate;
+	// normalising the cells and looking up their glyphs
+	double render;
+} jtoa_timings;
+
+// Counters of the last conversion, see jtoa_ctx.stats
+typedef struct jtoa_stats_ {
+	int source_width;
+	int source_height;
+	// size after DCT scaling, by scale_num/scale_denom
+	int decoded_width;
+	int decoded_height;
+	int scale_num;
+	int scale_denom;
+	// decoded scanlines that were accumulated, and the rest of them,
+	// skipped or left undecoded
+	int scanlines_decoded;
+	int scanlines_skipped;
+	// chars rendered into all outputs, without newlines
+	long cells;
+} jtoa_stats;
+
+// Decoder and buffers reused between conversions, see jtoa_free
+typedef struct jtoa_state_ jtoa_state;
+struct jtoa_kernels_;
+
+// Conversion options and per context state.  A context may be used by one
+// thread at a time; use one context per thread to convert in parallel.
+typedef struct jtoa_ctx_ {
+	// Output size.  With auto_height, height is calculated from width and
+	// the aspect ratio, with auto_width the other way around.
+	int width;
+	int height;
+	int auto_width;
+	int auto_height;
+
+	int invert;
+	int flipx;
+	int flipy;
+	// Leftmost char corresponds to black pixel, right-most to white
+	char ascii_palette[JTOA_PALETTE_SIZE+1];
+
+	// let libjpeg (or libwebp) downscale to the smallest size not below the
+	// output size
+	int dct_scale;
+	// average RGB components instead of decoding only the luminance
+	int luma_average;
+	// scanlines decoded per libjpeg call
+	int batch_rows;
+	// only decode the source row nearest to each output row
+	int fast_sampling;
+	// only decode this many scans of progressive JPEGs, 0 for all
+	int preview_scans;
+	// area-average instead of nearest horizontal resampling
+	int box_filter;
+	// threads decoding one image, in restart marker bands if the JPEG has
+	// them, else pipelining decoding and accumulation
+	int threads;
+	// JTOA_COLOR_* escapes coloring each char by the average color of its
+	// cell.  Decodes RGB, so chars are picked as with luma_average.
+	// Colored frames vary in size, see jtoa_render_mem.
+	int color;
+	// JTOA_GLYPHS_* sub-cell mode.  The modes besides ascii draw each of
+	// their pixels set or not as UTF-8 block or braille chars, ignoring
+	// ascii_palette.  Their frames vary in size, like colored ones.
+	int glyphs;
+	// JTOA_DITHER_* between the palette's (or glyph pixels') levels
+	int dither;
+	// JTOA_SIMD_* instruction set used for resampling and accumulation
+	int simd;
+
+	// only convert the given source region
+	int crop;
+	int crop_x;
+	int crop_y;
+	int crop_width;
+	int crop_height;
+
+	// print source and output information to stderr
+	int verbose;
+	// if set, each conversion fills in the time spent in its stages, and
+	// its counters.  Not shared with contexts created by jtoa_copy.
+	jtoa_timings *timings;
+	jtoa_stats *stats;
+
+	// state set up by jtoa_prepare
+	int prepared;
+	char glyph_lut[JTOA_LUT_SIZE];
+	const struct jtoa_kernels_ *kernels;
+
+	// created by the first conversion and released by jtoa_free
+	jtoa_state *state;
+
+	// message describing the last error
+	char error[JTOA_ERROR_SIZE];
+} jtoa_ctx;
+
+// Source and output dimensions reported by jtoa_read_info
+typedef struct jtoa_info_ {
+	int source_width;
+	int source_height;
+	int components;
+	int progressive;
+	// size of the text jtoa_render produces, in chars and lines
+	int width;
+	int height;
+} jtoa_info;
+
+// Set default options
+void jtoa_init(jtoa_ctx *ctx);
+
+// Initialise dst with the options of src, but without sharing its decoder
+// and buffers.  Use this rather than assignment to copy a context.
+void jtoa_copy(jtoa_ctx *dst, const jtoa_ctx *src);
+
+// Release the decoder and buffers kept by a context.  The context can
+// still be used afterwards, they are created again when needed.
+void jtoa_free(jtoa_ctx *ctx);
+
+// Validate options and set up state derived from them.  Must be called
+// after changing options and before rendering.  Returns 0 on success.
+int jtoa_prepare(jtoa_ctx *ctx);
+
+// Sources may also be in the formats libjtoa was built with besides JPEG,
+// PNG and WebP, which are recognised by their signature.  Those are read
+// into memory first and decoded on one thread, see jtoa_source.h.
+
+// Convert the JPEG read from src.  On success returns 0, and *dst_buf
+// holds *dst_size bytes of text, one line per row ending in a newline.
+// The buffer is allocated with malloc and must be freed by the caller.
+// On error returns nonzero and ctx->error holds a message.
+int jtoa_render(jtoa_ctx *ctx, FILE *src, char **dst_buf, size_t *dst_size);
+
+// Same as jtoa_render, but reads the JPEG from the src_size bytes at src
+int jtoa_render_buffer(jtoa_ctx *ctx, const void *src, size_t src_size,
+	char **dst_buf, size_t *dst_size);
+
+// Convert the JPEG in the src_size bytes at src, and write the text into
+// the dst_capacity bytes at dst, without allocating an output buffer.
+// *dst_size is set to the size of the text.  If that is larger than
+// dst_capacity, returns JTOA_BUFFER_TOO_SMALL before decoding the image.
+// With color, that check and its *dst_size use the largest possible size.
+int jtoa_render_mem(jtoa_ctx *ctx, const void *src, size_t src_size,
+	char *dst, size_t dst_capacity, size_t *dst_size);
+
+// Convert the JPEG read from src at each of count widths, with the height
+// of each calculated from the aspect ratio, decoding it only once.  On
+// success returns 0, and dst_bufs[n] holds dst_sizes[n] bytes of text at
+// widths[n], to be freed by the caller.  count is at most JTOA_MAX_WIDTHS.
+int jtoa_render_widths(jtoa_ctx *ctx, FILE *src, const int *widths, int count,
+	char **dst_bufs, size_t *dst_sizes);
+
+// Same as jtoa_render_widths, but reads the JPEG from the src_size bytes at src
+int jtoa_render_widths_buffer(jtoa_ctx *ctx, const void *src, size_t src_size,
+	const int *widths, int count, char **dst_bufs, size_t *dst_sizes);
+
+// Only read the header of the JPEG read from src, and fill in info
+// without decoding the image.  Returns 0 on success.
+int jtoa_read_info(jtoa_ctx *ctx, FILE *src, jtoa_info *info);
+
+// Same as jtoa_read_info, but reads the JPEG from the src_size bytes at src
+int jtoa_read_info_buffer(jtoa_ctx *ctx, const void *src, size_t src_size, jtoa_info *info);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
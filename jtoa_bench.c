@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jpeglib.h"
+
+#include "jtoa_bench.h"
+#include "jtoa_simd.h"
+#include "jtoa_util.h"
+
+#define BENCH_QUALITY 85
+
+// Stages reported per pass, the first of them from jtoa_timings
+enum { HEADER, DECODE, ACCUMULATE, RENDER, OUTPUT, TOTAL, STAGES };
+
+static const char *stage_names[STAGES] = {
+	"header", "decode", "accumulate", "render", "output", "total"
+};
+
+static unsigned char clamp(const int v) {
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+int bench_synthesize(const char *spec, unsigned char **data, size_t *size) {
+	struct jpeg_compress_struct jpg;
+	struct jpeg_error_mgr jerr;
+	char sampling[8] = "420";
+	int width, height, len, x, y;
+
+	if ( sscanf(spec, "%dx%d%n", &width, &height, &len) != 2 || width < 1 || height < 1 ||
+	     width > JPEG_MAX_DIMENSION || height > JPEG_MAX_DIMENSION )
+		return 1;
+	if ( spec[len] == ',' && strlen(spec + len + 1) < sizeof(sampling) )
+		strcpy(sampling, spec + len + 1);
+	else if ( spec[len] )
+		return 1;
+
+	const int gray = !strcmp(sampling, "gray");
+	int h_samp, v_samp;
+	if ( gray || !strcmp(sampling, "444") ) { h_samp = 1; v_samp = 1; }
+	else if ( !strcmp(sampling, "422") ) { h_samp = 2; v_samp = 1; }
+	else if ( !strcmp(sampling, "420") ) { h_samp = 2; v_samp = 2; }
+	else return 1;
+
+	unsigned char *row = (unsigned char*) malloc(width * 3);
+	if ( row == NULL )
+		return 1;
+
+	jpg.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&jpg);
+
+	unsigned char *out = NULL;
+	unsigned long out_size = 0;
+	jpeg_mem_dest(&jpg, &out, &out_size);
+
+	jpg.image_width = width;
+	jpg.image_height = height;
+	jpg.input_components = gray ? 1 : 3;
+	jpg.in_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+	jpeg_set_defaults(&jpg);
+	jpeg_set_quality(&jpg, BENCH_QUALITY, TRUE);
+	jpg.comp_info[0].h_samp_factor = h_samp;
+	jpg.comp_info[0].v_samp_factor = v_samp;
+	jpeg_start_compress(&jpg, TRUE);
+
+	// gradients under a checkerboard, with noise so that the entropy
+	// coded data is about as dense as in photos
+	uint32_t seed = 1;
+	for ( y=0; y < height; ++y ) {
+		for ( x=0; x < width; ++x ) {
+			seed = seed * 1664525 + 1013904223;
+			const int noise = (int) (seed >> 28) - 8;
+			const int check = ((x >> 6) + (y >> 6)) & 1 ? 48 : 0;
+			const int gx = (int) ((long) x * 255 / width), gy = (int) ((long) y * 255 / height);
+			if ( gray ) {
+				row[x] = clamp((gx + gy) / 2 + check + noise);
+			} else {
+				row[x*3] = clamp(gx + check + noise);
+				row[x*3+1] = clamp(gy - check + noise);
+				row[x*3+2] = clamp(255 - (gx + gy) / 2 + noise);
+			}
+		}
+		JSAMPROW rows[1] = { row };
+		jpeg_write_scanlines(&jpg, rows, 1);
+	}
+	jpeg_finish_compress(&jpg);
+	jpeg_destroy_compress(&jpg);
+	free(row);
+
+	*data = out;
+	*size = out_size;
+	return 0;
+}
+
+static int by_value(const void *a, const void *b) {
+	const double x = *(const double*) a, y = *(const double*) b;
+	return x < y ? -1 : x > y;
+}
+
+// Convert every input once, adding the time of each stage to pass
+static int bench_pass(jtoa_ctx *ctx, const BenchInput *inputs, const int count,
+	char **frame, size_t *capacity, FILE *sink, double *pass)
+{
+	jtoa_timings t;
+	int n, r = 0;
+
+	ctx->timings = &t;
+	for ( n=0; n < count; ++n ) {
+		const double start = jtoa_now();
+		size_t size;
+
+		while ( (r = jtoa_render_mem(ctx, inputs[n].data, inputs[n].size, *frame, *capacity, &size))
+			== JTOA_BUFFER_TOO_SMALL )
+		{
+			char *grown = (char*) realloc(*frame, size);
+			if ( grown == NULL ) {
+				fprintf(stderr, "Not enough memory\n");
+				return 1;
+			}
+			*frame = grown;
+			*capacity = size;
+		}
+		if ( r != 0 ) {
+			fprintf(stderr, "%s: %s\n", inputs[n].name, ctx->error);
+			break;
+		}
+
+		const double rendered = jtoa_now();
+		fwrite(*frame, 1, size, sink);
+		fflush(sink);
+		const double end = jtoa_now();
+
+		pass[HEADER] += t.header;
+		pass[DECODE] += t.decode;
+		pass[ACCUMULATE] += t.accumulate;
+		pass[RENDER] += t.render;
+		pass[OUTPUT] += end - rendered;
+		pass[TOTAL] += end - start;
+	}
+	ctx->timings = NULL;
+	return r;
+}
+
+int bench_run(jtoa_ctx *ctx, const BenchInput *inputs, const int count, const int runs) {
+	// one row of stages per pass, after the warm-up pass
+	double *samples = (double*) calloc((size_t) (runs + 1) * STAGES, sizeof(double));
+	double *values = (double*) malloc(runs * sizeof(double));
+	double pixels = 0;
+	// grown when jtoa_render_mem reports it too small
+	size_t capacity = 4096;
+	char *frame = (char*) malloc(capacity);
+	int n, s, r = 1;
+
+	FILE *sink = fopen("/dev/null", "w");
+	if ( samples == NULL || values == NULL || frame == NULL || sink == NULL ) {
+		fprintf(stderr, "Can't set up benchmark\n");
+		goto done;
+	}
+
+	for ( n=0; n < count; ++n ) {
+		jtoa_info info;
+		if ( (r = jtoa_read_info_buffer(ctx, inputs[n].data, inputs[n].size, &info)) != 0 ) {
+			fprintf(stderr, "%s: %s\n", inputs[n].name, ctx->error);
+			goto done;
+		}
+		pixels += (double) info.source_width * info.source_height;
+	}
+
+	// the first pass allocates the decoder and buffers, and is not counted
+	for ( n=0; n <= runs; ++n )
+		if ( (r = bench_pass(ctx, inputs, count, &frame, &capacity, sink, &samples[n * STAGES])) != 0 )
+			goto done;
+
+	printf("%d image%s, %.1f MP per pass, %d passes, %s kernels, %d thread%s\n",
+		count, count == 1 ? "" : "s", pixels * 1e-6, runs, ctx->kernels->name,
+		ctx->threads, ctx->threads == 1 ? "" : "s");
+	printf("%-12s %10s %10s %10s  (ms per pass)\n", "stage", "min", "median", "p99");
+
+	double median_total = 0;
+	for ( s=0; s < STAGES; ++s ) {
+		for ( n=0; n < runs; ++n )
+			values[n] = samples[(n + 1) * STAGES + s];
+		qsort(values, runs, sizeof(double), by_value);
+		const double median = runs % 2 ? values[runs / 2] : (values[runs/2 - 1] + values[runs/2]) / 2;
+		// nearest rank
+		const int p99 = (99 * runs + 99) / 100 - 1;
+		printf("%-12s %10.3f %10.3f %10.3f\n", stage_names[s], values[0] * 1e3, median * 1e3,
+			values[p99] * 1e3);
+		if ( s == TOTAL )
+			median_total = median;
+	}
+
+	if ( median_total > 0 )
+		printf("%.1f images/s, %.1f MP/s\n", count / median_total, pixels * 1e-6 / median_total);
+	r = 0;
+
+done:
+	if ( sink )
+		fclose(sink);
+	free(samples);
+	free(values);
+	free(frame);
+	return r;
+}
@@ -0,0 +1,28 @@
+#ifndef JTOA_BENCH_H
+#define JTOA_BENCH_H
+
+#include <stddef.h>
+
+#include "jtoa.h"
+
+// A JPEG held in memory for benchmarking, so that reading it from disk is
+// not measured
+typedef struct BenchInput_ {
+	const char *name;
+	const void *data;
+	size_t size;
+} BenchInput;
+
+// Encode a test image described by spec, "WxH" optionally followed by
+// ",444", ",422", ",420" (the default) or ",gray" for the chroma
+// subsampling.  On success returns 0 and *data holds *size bytes allocated
+// with malloc.  Returns nonzero if spec is invalid.
+int bench_synthesize(const char *spec, unsigned char **data, size_t *size);
+
+// Convert all count inputs with the options of ctx once to warm up, then
+// runs more times, and print the min, median and 99th percentile time of
+// each stage per pass over the inputs, and the throughput, to stdout.
+// Returns nonzero if a conversion fails.
+int bench_run(jtoa_ctx *ctx, const BenchInput *inputs, int count, int runs);
+
+#endif
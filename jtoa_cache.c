@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "jtoa_cache.h"
+
+// Bump when the rendering changes, so that old frames are not reused
+#define CACHE_VERSION 1
+
+// Temporary files older than this are left over from crashed writers
+#define CACHE_STALE_SECONDS 600
+
+#define HASH_MUL 0x9E3779B97F4A7C15ULL
+
+static uint64_t mix(uint64_t h) {
+	h ^= h >> 31;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 29;
+	return h;
+}
+
+// Fast non-cryptographic hash, eight bytes at a time
+static uint64_t hash(const void *data, const size_t size, uint64_t h) {
+	const unsigned char *p = (const unsigned char*) data;
+	size_t n = size;
+
+	h ^= size * HASH_MUL;
+	for ( ; n >= 8; n -= 8, p += 8 ) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ mix(w)) * HASH_MUL;
+	}
+	uint64_t w = 0;
+	memcpy(&w, p, n);
+	return mix((h ^ mix(w)) * HASH_MUL);
+}
+
+void cache_key(const jtoa_ctx *ctx, const int *widths, const int width_count,
+	const void *data, const size_t size, char key[CACHE_KEY_SIZE])
+{
+	char options[JTOA_PALETTE_SIZE + 200 + JTOA_MAX_WIDTHS * 12];
+	int i;
+
+	// everything that changes the output, but not e.g. simd or batch_rows
+	int n = snprintf(options, sizeof(options),
+		"%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %s",
+		CACHE_VERSION, ctx->width, ctx->height, ctx->auto_width, ctx->auto_height,
+		ctx->invert, ctx->flipx, ctx->flipy, ctx->dct_scale, ctx->luma_average,
+		ctx->fast_sampling, ctx->box_filter, ctx->preview_scans, ctx->crop, ctx->crop_x,
+		ctx->crop_y, ctx->crop_width, ctx->crop_height, JTOA_LUT_BITS, ctx->color, ctx->glyphs, ctx->dither, ctx->ascii_palette);
+	for ( i=0; i < width_count; ++i )
+		n += snprintf(options + n, sizeof(options) - n, " %d", widths[i]);
+
+	snprintf(key, CACHE_KEY_SIZE, "%016llx%016llx",
+		(unsigned long long) hash(data, size, 0),
+		(unsigned long long) hash(options, n, 1));
+}
+
+int cache_load(const char *dir, const char *key, char **frame, size_t *size) {
+	char path[4096];
+	struct stat st;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, key);
+	if ( (fd = open(path, O_RDONLY)) < 0 )
+		return 1;
+	if ( fstat(fd, &st) != 0 || st.st_size == 0 || (*frame = (char*) malloc(st.st_size)) == NULL ) {
+		close(fd);
+		return 1;
+	}
+
+	size_t got = 0;
+	while ( got < (size_t) st.st_size ) {
+		const ssize_t n = read(fd, *frame + got, st.st_size - got);
+		if ( n <= 0 ) {
+			free(*frame);
+			close(fd);
+			return 1;
+		}
+		got += n;
+	}
+	*size = got;
+
+	// mark as recently used
+	futimens(fd, NULL);
+	close(fd);
+	return 0;
+}
+
+typedef struct Entry_ {
+	time_t mtime;
+	off_t size;
+	char name[CACHE_KEY_SIZE];
+} Entry;
+
+static int by_mtime(const void *a, const void *b) {
+	const time_t x = ((const Entry*) a)->mtime, y = ((const Entry*) b)->mtime;
+	return x < y ? -1 : x > y;
+}
+
+// Bytes of frames in the cache directory as of its last scan, plus the
+// frames this process stored since.  Frames stored by other processes
+// sharing the directory are counted by the next scan, so the directory
+// may grow past the limit until one of them triggers it.
+static struct {
+	pthread_mutex_t lock;
+	int scanned;
+	char dir[4096];
+	size_t total;
+} usage = { PTHREAD_MUTEX_INITIALIZER, 0, "", 0 };
+
+// Remove the least recently used frames until dir holds at most max_size
+// bytes, and temporary files left behind by crashed writers.  Returns the
+// bytes of frames left.
+static size_t evict(const char *dir, const size_t max_size) {
+	char path[4096];
+	Entry *entries = NULL;
+	size_t count = 0, capacity = 0, total = 0, n;
+	struct dirent *d;
+	struct stat st;
+	DIR *dp;
+
+	if ( (dp = opendir(dir)) == NULL )
+		return 0;
+
+	const time_t now = time(NULL);
+	while ( (d = readdir(dp)) != NULL ) {
+		snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+		if ( stat(path, &st) != 0 || !S_ISREG(st.st_mode) )
+			continue;
+
+		if ( !strncmp(d->d_name, ".tmp-", 5) ) {
+			if ( now - st.st_mtime > CACHE_STALE_SECONDS )
+				unlink(path);
+			continue;
+		}
+		if ( strlen(d->d_name) != CACHE_KEY_SIZE - 1 )
+			continue;
+
+		if ( count == capacity ) {
+			Entry *grown = (Entry*) realloc(entries, (capacity + 256) * sizeof(Entry));
+			if ( grown == NULL )
+				break;
+			entries = grown;
+			capacity += 256;
+		}
+		entries[count].mtime = st.st_mtime;
+		entries[count].size = st.st_size;
+		strcpy(entries[count].name, d->d_name);
+		total += st.st_size;
+		++count;
+	}
+	closedir(dp);
+
+	if ( total > max_size ) {
+		qsort(entries, count, sizeof(Entry), by_mtime);
+		for ( n=0; n < count && total > max_size; ++n ) {
+			snprintf(path, sizeof(path), "%s/%s", dir, entries[n].name);
+			// another process may have evicted it already
+			if ( unlink(path) == 0 )
+				total -= entries[n].size;
+		}
+	}
+	free(entries);
+	return total;
+}
+
+int cache_store(const char *dir, const char *key, const char *frame, const size_t size, const size_t max_size) {
+	char tmp[4096], path[4096];
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s/.tmp-XXXXXX", dir);
+	if ( (fd = mkstemp(tmp)) < 0 )
+		return 1;
+
+	size_t done = 0;
+	while ( done < size ) {
+		const ssize_t n = write(fd, frame + done, size - done);
+		if ( n < 0 ) {
+			close(fd);
+			unlink(tmp);
+			return 1;
+		}
+		done += n;
+	}
+	fchmod(fd, 0644);
+
+	// readers see either no frame or all of it
+	snprintf(path, sizeof(path), "%s/%s", dir, key);
+	if ( close(fd) != 0 || rename(tmp, path) != 0 ) {
+		unlink(tmp);
+		return 1;
+	}
+
+	// scan the directory once, and again only when the frames stored since
+	// take it past max_size
+	pthread_mutex_lock(&usage.lock);
+	if ( !usage.scanned || strcmp(usage.dir, dir) ) {
+		usage.total = evict(dir, max_size);
+		snprintf(usage.dir, sizeof(usage.dir), "%s", dir);
+		usage.scanned = 1;
+	} else if ( (usage.total += size) > max_size ) {
+		usage.total = evict(dir, max_size);
+	}
+	pthread_mutex_unlock(&usage.lock);
+	return 0;
+}
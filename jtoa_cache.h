@@ -0,0 +1,32 @@
+#ifndef JTOA_CACHE_H
+#define JTOA_CACHE_H
+
+#include <stddef.h>
+
+#include "jtoa.h"
+
+// 32 hex digits and a terminating zero
+#define CACHE_KEY_SIZE 33
+
+// On-disk cache of rendered frames, one file per frame named by its key.
+// Files are written under a temporary name and renamed into place, so
+// several processes can share a directory.  Hits refresh the modification
+// time, which cache_store uses to evict the least recently used frames.
+
+// Key for rendering the size bytes at data with the options of ctx, at the
+// width_count widths if not zero
+void cache_key(const jtoa_ctx *ctx, const int *widths, int width_count,
+	const void *data, size_t size, char key[CACHE_KEY_SIZE]);
+
+// Look up key in dir.  On a hit returns 0, and *frame holds *size bytes
+// allocated with malloc.  Returns nonzero on a miss.
+int cache_load(const char *dir, const char *key, char **frame, size_t *size);
+
+// Store a frame under key in dir, then evict the least recently used
+// frames until the files in dir take at most max_size bytes.  dir is
+// scanned on the first store, and later only when the frames stored
+// since exceed max_size.  Returns nonzero if the frame could not be
+// stored.
+int cache_store(const char *dir, const char *key, const char *frame, size_t size, size_t max_size);
+
+#endif
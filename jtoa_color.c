@@ -0,0 +1,91 @@
+#include <pthread.h>
+#include <stdint.h>
+
+#include "jtoa.h"
+#include "jtoa_color.h"
+
+// xterm's defaults for the 16 ANSI colors
+static const unsigned char ansi16[16][3] = {
+	{   0,   0,   0 }, { 205,   0,   0 }, {   0, 205,   0 }, { 205, 205,   0 },
+	{   0,   0, 238 }, { 205,   0, 205 }, {   0, 205, 205 }, { 229, 229, 229 },
+	{ 127, 127, 127 }, { 255,   0,   0 }, {   0, 255,   0 }, { 255, 255,   0 },
+	{  92,  92, 255 }, { 255,   0, 255 }, {   0, 255, 255 }, { 255, 255, 255 },
+};
+
+// Channel levels of the 6x6x6 cube at xterm-256 colors 16 to 231
+static const int cube_levels[6] = { 0, 95, 135, 175, 215, 255 };
+
+static unsigned char lut_256[COLOR_LUT_SIZE];
+static unsigned char lut_16[COLOR_LUT_SIZE];
+static pthread_once_t lut_once = PTHREAD_ONCE_INIT;
+
+static int distance(const int r, const int g, const int b, const int pr, const int pg, const int pb) {
+	return (r - pr) * (r - pr) + (g - pg) * (g - pg) + (b - pb) * (b - pb);
+}
+
+static int nearest_level(const int v) {
+	return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40;
+}
+
+static void build_luts() {
+	int index;
+
+	for ( index=0; index < COLOR_LUT_SIZE; ++index ) {
+		// centre of the cell of colors sharing this index
+		const int r = (index >> 10) << 3 | 4, g = (index >> 5 & 31) << 3 | 4, b = (index & 31) << 3 | 4;
+		int n;
+
+		// nearest cube color, or one of the 24 grays from 8 to 238
+		const int cr = nearest_level(r), cg = nearest_level(g), cb = nearest_level(b);
+		const int cube = distance(r, g, b, cube_levels[cr], cube_levels[cg], cube_levels[cb]);
+		int gray = ((r + g + b) / 3 - 3) / 10;
+		if ( gray < 0 ) gray = 0;
+		if ( gray > 23 ) gray = 23;
+		const int level = 8 + 10 * gray;
+		lut_256[index] = distance(r, g, b, level, level, level) < cube ?
+			232 + gray : 16 + 36 * cr + 6 * cg + cb;
+
+		int best = 0, best_distance = 1 << 30;
+		for ( n=0; n < 16; ++n ) {
+			const int d = distance(r, g, b, ansi16[n][0], ansi16[n][1], ansi16[n][2]);
+			if ( d < best_distance ) { best = n; best_distance = d; }
+		}
+		lut_16[index] = best;
+	}
+}
+
+const unsigned char* jtoa_color_lut(const int color) {
+	if ( color != JTOA_COLOR_256 && color != JTOA_COLOR_16 )
+		return NULL;
+	pthread_once(&lut_once, build_luts);
+	return color == JTOA_COLOR_256 ? lut_256 : lut_16;
+}
+
+static char* put_number(char *p, const unsigned v) {
+	if ( v >= 100 ) *p++ = '0' + v / 100;
+	if ( v >= 10 ) *p++ = '0' + v / 10 % 10;
+	*p++ = '0' + v % 10;
+	return p;
+}
+
+int jtoa_color_escape(const int color, const uint32_t code, char *out) {
+	char *p = out;
+
+	*p++ = '\033';
+	*p++ = '[';
+	if ( color == JTOA_COLOR_16 ) {
+		p = put_number(p, code < 8 ? 30 + code : 90 + code - 8);
+	} else if ( color == JTOA_COLOR_256 ) {
+		*p++ = '3'; *p++ = '8'; *p++ = ';'; *p++ = '5'; *p++ = ';';
+		p = put_number(p, code);
+	} else {
+		*p++ = '3'; *p++ = '8'; *p++ = ';'; *p++ = '2'; *p++ = ';';
+		p = put_number(p, code >> 16);
+		*p++ = ';';
+		p = put_number(p, code >> 8 & 0xFF);
+		*p++ = ';';
+		p = put_number(p, code & 0xFF);
+	}
+	*p++ = 'm';
+	return p - out;
+}
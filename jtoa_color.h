@@ -0,0 +1,30 @@
+#ifndef JTOA_COLOR_H
+#define JTOA_COLOR_H
+
+#include <stdint.h>
+
+// Quantisation of cell colors to terminal palettes, and their SGR escapes
+
+// Longest escape, "\033[38;2;255;255;255m", and the reset at line ends
+#define COLOR_ESCAPE_MAX 19
+#define COLOR_RESET "\033[0m"
+#define COLOR_RESET_LEN 4
+
+// Limit a channel average to 255, so that the truecolor escape and
+// COLOR_LUT_INDEX get a valid channel whatever the rounding of the sums
+#define COLOR_CLAMP(v) ((v) < 255 ? (v) : 255)
+
+// Index into the lookup tables of jtoa_color_lut, 5 bits per channel
+#define COLOR_LUT_INDEX(r, g, b) (((r) >> 3) << 10 | ((g) >> 3) << 5 | (b) >> 3)
+#define COLOR_LUT_SIZE (1 << 15)
+
+// Table of the nearest palette entry for each COLOR_LUT_INDEX, for
+// JTOA_COLOR_256 or JTOA_COLOR_16, built on first use.  NULL for other
+// modes.
+const unsigned char* jtoa_color_lut(int color);
+
+// Write the escape setting the foreground to code, a palette index or
+// 0xRRGGBB for JTOA_COLOR_TRUECOLOR, to out.  Returns its length.
+int jtoa_color_escape(int color, uint32_t code, char *out);
+
+#endif
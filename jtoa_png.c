@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <png.h>
+
+#include "jtoa.h"
+#include "jtoa_source.h"
+
+typedef struct Png_ {
+	png_structp png;
+	png_infop info;
+	const unsigned char *data;
+	size_t size;
+	size_t pos;
+	// where libpng errors are reported
+	char *error;
+	// interlaced images are decoded whole by start
+	unsigned char *image;
+	png_bytep *rows;
+	size_t stride;
+	int row;
+} Png;
+
+static void png_error_exit(png_structp png, png_const_charp message) {
+	Png *p = (Png*) png_get_error_ptr(png);
+	snprintf(p->error, JTOA_ERROR_SIZE, "%s", message);
+	png_longjmp(png, 1);
+}
+
+static void png_warning_ignore(png_structp png, png_const_charp message) {
+	(void) png;
+	(void) message;
+}
+
+static void png_read_memory(png_structp png, png_bytep out, png_size_t length) {
+	Png *p = (Png*) png_get_io_ptr(png);
+	if ( length > p->size - p->pos )
+		png_error(png, "Premature end of PNG file");
+	memcpy(out, p->data + p->pos, length);
+	p->pos += length;
+}
+
+static int png_match(const unsigned char *data, const size_t size) {
+	return size >= 8 && !png_sig_cmp(data, 0, 8);
+}
+
+static void png_close(void *handle) {
+	Png *p = (Png*) handle;
+	png_destroy_read_struct(&p->png, &p->info, NULL);
+	free(p->image);
+	free(p->rows);
+	free(p);
+}
+
+static int png_open(jtoa_ctx *ctx, const unsigned char *data, const size_t size, void **handle, Decoded *d) {
+	Png *p = (Png*) calloc(1, sizeof(Png));
+
+	if ( p == NULL ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Not enough memory");
+		return JTOA_ERROR;
+	}
+	p->data = data;
+	p->size = size;
+	p->error = ctx->error;
+	p->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, p, png_error_exit, png_warning_ignore);
+	if ( p->png == NULL || (p->info = png_create_info_struct(p->png)) == NULL ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Can't create PNG decoder");
+		png_close(p);
+		return JTOA_ERROR;
+	}
+	if ( setjmp(png_jmpbuf(p->png)) ) {
+		png_close(p);
+		return JTOA_ERROR;
+	}
+	png_set_read_fn(p->png, p, png_read_memory);
+	png_read_info(p->png, p->info);
+
+	d->format = "PNG";
+	d->image_width = png_get_image_width(p->png, p->info);
+	d->image_height = png_get_image_height(p->png, p->info);
+	d->num_components = png_get_channels(p->png, p->info);
+	d->progressive = png_get_interlace_type(p->png, p->info) != PNG_INTERLACE_NONE;
+	*handle = p;
+	return 0;
+}
+
+static int png_start(jtoa_ctx *ctx, void *handle, const int max_width, const int max_height, Decoded *d) {
+	Png *p = (Png*) handle;
+	int y;
+
+	(void) max_width;
+	(void) max_height;
+	if ( setjmp(png_jmpbuf(p->png)) )
+		return JTOA_ERROR;
+
+	// 8 bit gray or RGB samples, without alpha
+	const int color_type = png_get_color_type(p->png, p->info);
+	if ( color_type == PNG_COLOR_TYPE_PALETTE )
+		png_set_palette_to_rgb(p->png);
+	if ( color_type == PNG_COLOR_TYPE_GRAY && png_get_bit_depth(p->png, p->info) < 8 )
+		png_set_expand_gray_1_2_4_to_8(p->png);
+	if ( png_get_bit_depth(p->png, p->info) == 16 )
+		png_set_strip_16(p->png);
+	if ( color_type & PNG_COLOR_MASK_ALPHA )
+		png_set_strip_alpha(p->png);
+	// the luminance of JPEGs is Rec. 601 too
+	if ( (color_type & PNG_COLOR_MASK_COLOR) && !ctx->luma_average && !ctx->color )
+		png_set_rgb_to_gray_fixed(p->png, 1, 29900, 58700);
+	const int passes = png_set_interlace_handling(p->png);
+	png_read_update_info(p->png, p->info);
+
+	d->components = png_get_channels(p->png, p->info);
+	d->output_width = d->image_width;
+	d->output_height = d->image_height;
+	d->scale_num = d->scale_denom = 1;
+	p->stride = png_get_rowbytes(p->png, p->info);
+
+	if ( passes > 1 ) {
+		if ( (p->image = (unsigned char*) malloc(p->stride * d->image_height)) == NULL ||
+		     (p->rows = (png_bytep*) malloc(d->image_height * sizeof(png_bytep))) == NULL )
+			png_error(p->png, "Not enough memory for interlaced PNG");
+		for ( y=0; y < d->image_height; ++y )
+			p->rows[y] = p->image + (size_t) y * p->stride;
+		png_read_image(p->png, p->rows);
+	}
+	return 0;
+}
+
+static int png_read(jtoa_ctx *ctx, void *handle, unsigned char **rows, const int count) {
+	Png *p = (Png*) handle;
+	int r;
+
+	(void) ctx;
+	if ( p->image ) {
+		for ( r=0; r < count; ++r )
+			rows[r] = p->image + (size_t) (p->row + r) * p->stride;
+		p->row += count;
+		return count;
+	}
+	if ( setjmp(png_jmpbuf(p->png)) )
+		return -1;
+	for ( r=0; r < count; ++r )
+		png_read_row(p->png, rows[r], NULL);
+	p->row += count;
+	return count;
+}
+
+const Provider jtoa_png_provider = { "PNG", png_match, png_open, png_start, png_read, png_close };
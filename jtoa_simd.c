@@ -0,0 +1,277 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "jtoa.h"
+#include "jtoa_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+static void prefix_sum_scalar(const unsigned char *src, const int count, uint32_t *sum) {
+	int n;
+	sum[0] = 0;
+	for ( n=0; n < count; ++n )
+		sum[n+1] = sum[n] + src[n];
+}
+
+static void box_row_scalar(const uint32_t *sum, const int *start, const int *end,
+	const uint32_t *weight, const int count, uint32_t *out)
+{
+	int x;
+	for ( x=0; x < count; ++x )
+		out[x] = WEIGH(sum[ end[x] ] - sum[ start[x] ], weight[x]);
+}
+
+static void accumulate_scalar(uint32_t *dst, const uint32_t *src, const int count) {
+	int x;
+	for ( x=0; x < count; ++x )
+		dst[x] += src[x];
+}
+
+static const Kernels scalar_kernels = { "scalar", prefix_sum_scalar, box_row_scalar, accumulate_scalar, NULL };
+
+#ifdef HAVE_X86_SIMD
+
+// Scan 16 bytes at a time: widened to two vectors of 8 words, each summed
+// in register by adding it shifted by 1, 2 and 4 words (the words can't
+// overflow, 8 * 255 < 65536), then widened again and offset by the total
+// of the bytes before them.  AVX2 has no cheaper form, its shifts don't
+// cross 128 bit lanes.
+__attribute__((target("sse2")))
+static void prefix_sum_sse2(const unsigned char *src, const int count, uint32_t *sum) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i carry = zero;
+	int n = 0;
+
+	sum[0] = 0;
+	for ( ; n + 16 <= count; n += 16 ) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) &src[n]);
+		__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+		lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 2));
+		hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 2));
+		lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 4));
+		hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 4));
+		lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 8));
+		hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 8));
+
+		const __m128i s0 = _mm_add_epi32(_mm_unpacklo_epi16(lo, zero), carry);
+		const __m128i s1 = _mm_add_epi32(_mm_unpackhi_epi16(lo, zero), carry);
+		carry = _mm_shuffle_epi32(s1, 0xFF);
+		const __m128i s2 = _mm_add_epi32(_mm_unpacklo_epi16(hi, zero), carry);
+		const __m128i s3 = _mm_add_epi32(_mm_unpackhi_epi16(hi, zero), carry);
+		carry = _mm_shuffle_epi32(s3, 0xFF);
+
+		_mm_storeu_si128((__m128i*) &sum[n+1], s0);
+		_mm_storeu_si128((__m128i*) &sum[n+5], s1);
+		_mm_storeu_si128((__m128i*) &sum[n+9], s2);
+		_mm_storeu_si128((__m128i*) &sum[n+13], s3);
+	}
+	for ( ; n < count; ++n )
+		sum[n+1] = sum[n] + src[n];
+}
+
+// SSE2 has no 32 bit multiply, so weigh the even and odd lanes in 64 bits
+// with pmuludq, exactly as WEIGH does
+__attribute__((target("sse2")))
+static void box_row_sse2(const uint32_t *sum, const int *start, const int *end,
+	const uint32_t *weight, const int count, uint32_t *out)
+{
+	const __m128i half = _mm_set1_epi64x(1 << (BOX_WEIGHT_BITS - 1));
+	const __m128i low = _mm_set1_epi64x(0xFFFFFFFF);
+	int x = 0;
+
+	for ( ; x + 4 <= count; x += 4 ) {
+		const __m128i d = _mm_set_epi32(sum[ end[x+3] ] - sum[ start[x+3] ], sum[ end[x+2] ] - sum[ start[x+2] ],
+			sum[ end[x+1] ] - sum[ start[x+1] ], sum[ end[x] ] - sum[ start[x] ]);
+		const __m128i w = _mm_loadu_si128((const __m128i*) &weight[x]);
+		const __m128i even = _mm_srli_epi64(_mm_add_epi64(_mm_mul_epu32(d, w), half), BOX_WEIGHT_BITS);
+		const __m128i odd = _mm_srli_epi64(_mm_add_epi64(
+			_mm_mul_epu32(_mm_srli_epi64(d, 32), _mm_srli_epi64(w, 32)), half), BOX_WEIGHT_BITS);
+		_mm_storeu_si128((__m128i*) &out[x], _mm_or_si128(_mm_and_si128(even, low), _mm_slli_epi64(odd, 32)));
+	}
+	for ( ; x < count; ++x )
+		out[x] = WEIGH(sum[ end[x] ] - sum[ start[x] ], weight[x]);
+}
+
+__attribute__((target("sse2")))
+static void accumulate_sse2(uint32_t *dst, const uint32_t *src, const int count) {
+	int x = 0;
+	for ( ; x + 4 <= count; x += 4 ) {
+		const __m128i d = _mm_loadu_si128((const __m128i*) &dst[x]);
+		const __m128i s = _mm_loadu_si128((const __m128i*) &src[x]);
+		_mm_storeu_si128((__m128i*) &dst[x], _mm_add_epi32(d, s));
+	}
+	for ( ; x < count; ++x )
+		dst[x] += src[x];
+}
+
+static const Kernels sse2_kernels = { "sse2", prefix_sum_sse2, box_row_sse2, accumulate_sse2, NULL };
+
+// Gather the span ends of 8 columns, and weigh them in 32 bits, see
+// BOX_WEIGHT_BITS
+__attribute__((target("avx2")))
+static void box_row_avx2(const uint32_t *sum, const int *start, const int *end,
+	const uint32_t *weight, const int count, uint32_t *out)
+{
+	const __m256i half = _mm256_set1_epi32(1 << (BOX_WEIGHT_BITS - 1));
+	int x = 0;
+
+	for ( ; x + 8 <= count; x += 8 ) {
+		const __m256i s = _mm256_i32gather_epi32((const int*) sum,
+			_mm256_loadu_si256((const __m256i*) &start[x]), 4);
+		const __m256i e = _mm256_i32gather_epi32((const int*) sum,
+			_mm256_loadu_si256((const __m256i*) &end[x]), 4);
+		const __m256i w = _mm256_loadu_si256((const __m256i*) &weight[x]);
+		const __m256i v = _mm256_mullo_epi32(_mm256_sub_epi32(e, s), w);
+		_mm256_storeu_si256((__m256i*) &out[x], _mm256_srli_epi32(_mm256_add_epi32(v, half), BOX_WEIGHT_BITS));
+	}
+	for ( ; x < count; ++x )
+		out[x] = WEIGH(sum[ end[x] ] - sum[ start[x] ], weight[x]);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint32_t *dst, const uint32_t *src, const int count) {
+	int x = 0;
+	for ( ; x + 8 <= count; x += 8 ) {
+		const __m256i d = _mm256_loadu_si256((const __m256i*) &dst[x]);
+		const __m256i s = _mm256_loadu_si256((const __m256i*) &src[x]);
+		_mm256_storeu_si256((__m256i*) &dst[x], _mm256_add_epi32(d, s));
+	}
+	for ( ; x < count; ++x )
+		dst[x] += src[x];
+}
+
+// Gather a pixel per column, and add up its components (the low byte of
+// gray pixels, three of RGB or all four) with byte and word multiply-adds
+// by one, which sum neighbouring lanes
+__attribute__((target("avx2")))
+static int gather_avx2(const unsigned char *src, const int *lookup, const int components, const int count,
+	uint32_t *out)
+{
+	const __m256i mask = _mm256_set1_epi32(components == 1 ? 0xFF : components == 3 ? 0xFFFFFF : -1);
+	const __m256i ones8 = _mm256_set1_epi8(1), ones16 = _mm256_set1_epi16(1);
+	int x = 0;
+
+	if ( components != 1 && components != 3 && components != 4 )
+		return 0;
+	for ( ; x + 8 <= count; x += 8 ) {
+		__m256i v = _mm256_i32gather_epi32((const int*) src, _mm256_loadu_si256((const __m256i*) &lookup[x]), 1);
+		v = _mm256_and_si256(v, mask);
+		if ( components != 1 )
+			v = _mm256_madd_epi16(_mm256_maddubs_epi16(v, ones8), ones16);
+		_mm256_storeu_si256((__m256i*) &out[x], v);
+	}
+	return x;
+}
+
+static const Kernels avx2_kernels = { "avx2", prefix_sum_sse2, box_row_avx2, accumulate_avx2, gather_avx2 };
+
+#endif // HAVE_X86_SIMD
+
+#ifdef HAVE_NEON
+
+// The scan of prefix_sum_sse2, with vext shifting in zero words
+static void prefix_sum_neon(const unsigned char *src, const int count, uint32_t *sum) {
+	const uint16x8_t zero = vdupq_n_u16(0);
+	uint32x4_t carry = vdupq_n_u32(0);
+	int n = 0;
+
+	sum[0] = 0;
+	for ( ; n + 16 <= count; n += 16 ) {
+		const uint8x16_t v = vld1q_u8(&src[n]);
+		uint16x8_t lo = vmovl_u8(vget_low_u8(v)), hi = vmovl_u8(vget_high_u8(v));
+		lo = vaddq_u16(lo, vextq_u16(zero, lo, 7));
+		hi = vaddq_u16(hi, vextq_u16(zero, hi, 7));
+		lo = vaddq_u16(lo, vextq_u16(zero, lo, 6));
+		hi = vaddq_u16(hi, vextq_u16(zero, hi, 6));
+		lo = vaddq_u16(lo, vextq_u16(zero, lo, 4));
+		hi = vaddq_u16(hi, vextq_u16(zero, hi, 4));
+
+		const uint32x4_t s0 = vaddq_u32(vmovl_u16(vget_low_u16(lo)), carry);
+		const uint32x4_t s1 = vaddq_u32(vmovl_u16(vget_high_u16(lo)), carry);
+		carry = vdupq_laneq_u32(s1, 3);
+		const uint32x4_t s2 = vaddq_u32(vmovl_u16(vget_low_u16(hi)), carry);
+		const uint32x4_t s3 = vaddq_u32(vmovl_u16(vget_high_u16(hi)), carry);
+		carry = vdupq_laneq_u32(s3, 3);
+
+		vst1q_u32(&sum[n+1], s0);
+		vst1q_u32(&sum[n+5], s1);
+		vst1q_u32(&sum[n+9], s2);
+		vst1q_u32(&sum[n+13], s3);
+	}
+	for ( ; n < count; ++n )
+		sum[n+1] = sum[n] + src[n];
+}
+
+// NEON has no gather; the differences are gathered one by one and
+// weighed four at a time, in 32 bits as in box_row_avx2
+static void box_row_neon(const uint32_t *sum, const int *start, const int *end,
+	const uint32_t *weight, const int count, uint32_t *out)
+{
+	const uint32x4_t half = vdupq_n_u32(1 << (BOX_WEIGHT_BITS - 1));
+	int x = 0;
+
+	for ( ; x + 4 <= count; x += 4 ) {
+		uint32_t d[4];
+		int k;
+		for ( k=0; k < 4; ++k )
+			d[k] = sum[ end[x+k] ] - sum[ start[x+k] ];
+		const uint32x4_t v = vmulq_u32(vld1q_u32(d), vld1q_u32(&weight[x]));
+		vst1q_u32(&out[x], vshrq_n_u32(vaddq_u32(v, half), BOX_WEIGHT_BITS));
+	}
+	for ( ; x < count; ++x )
+		out[x] = WEIGH(sum[ end[x] ] - sum[ start[x] ], weight[x]);
+}
+
+static void accumulate_neon(uint32_t *dst, const uint32_t *src, const int count) {
+	int x = 0;
+	for ( ; x + 4 <= count; x += 4 )
+		vst1q_u32(&dst[x], vaddq_u32(vld1q_u32(&dst[x]), vld1q_u32(&src[x])));
+	for ( ; x < count; ++x )
+		dst[x] += src[x];
+}
+
+static const Kernels neon_kernels = { "neon", prefix_sum_neon, box_row_neon, accumulate_neon, NULL };
+
+#endif // HAVE_NEON
+
+const Kernels* jtoa_select_kernels(const int simd) {
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	const int have_sse2 = __builtin_cpu_supports("sse2");
+	const int have_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+	switch ( simd ) {
+	case JTOA_SIMD_SCALAR:
+		return &scalar_kernels;
+#ifdef HAVE_X86_SIMD
+	case JTOA_SIMD_SSE2:
+		return have_sse2 ? &sse2_kernels : NULL;
+	case JTOA_SIMD_AVX2:
+		return have_avx2 ? &avx2_kernels : NULL;
+#endif
+#ifdef HAVE_NEON
+	case JTOA_SIMD_NEON:
+		return &neon_kernels;
+#endif
+	case JTOA_SIMD_AUTO:
+#ifdef HAVE_X86_SIMD
+		if ( have_avx2 ) return &avx2_kernels;
+		if ( have_sse2 ) return &sse2_kernels;
+#endif
+#ifdef HAVE_NEON
+		return &neon_kernels;
+#endif
+		return &scalar_kernels;
+	default:
+		return NULL;
+	}
+}
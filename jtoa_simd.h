@@ -0,0 +1,37 @@
+#ifndef JTOA_SIMD_H
+#define JTOA_SIMD_H
+
+#include <stdint.h>
+
+// Box filter weights are floor(2^BOX_WEIGHT_BITS / n) for a span of n
+// pixels.  Rounding down keeps a weighed span of up to 4 components at
+// most 255 * 4, and with 22 bits its product 255 * 4 * n * weight, plus
+// the rounding, still fits 32 bits.
+#define BOX_WEIGHT_BITS 22
+#define WEIGH(sum, weight) \
+	(uint32_t) (((uint64_t) (sum) * (weight) + (1 << (BOX_WEIGHT_BITS - 1))) >> BOX_WEIGHT_BITS)
+
+// Inner loops of the accumulation, with one implementation per
+// instruction set.  The scalar kernels are the reference.
+typedef struct jtoa_kernels_ {
+	const char *name;
+	// sum[0] = 0 and sum[n+1] = sum[n] + src[n] for n < count
+	void (*prefix_sum)(const unsigned char *src, int count, uint32_t *sum);
+	// out[x] = WEIGH(sum[end[x]] - sum[start[x]], weight[x]) for x < count
+	void (*box_row)(const uint32_t *sum, const int *start, const int *end,
+		const uint32_t *weight, int count, uint32_t *out);
+	// dst[x] += src[x] for x < count
+	void (*accumulate)(uint32_t *dst, const uint32_t *src, int count);
+	// Nearest neighbour resampling: out[x] = the sum of the components
+	// bytes at src + lookup[x], for as many leading x < count as the
+	// kernel handles, which is returned.  Reads 4 bytes at each lookup[x].
+	// NULL for instruction sets without a gather (SSE2 and NEON), where
+	// the scalar loop of the caller does all columns.
+	int (*gather)(const unsigned char *src, const int *lookup, int components, int count, uint32_t *out);
+} Kernels;
+
+// Kernels for a JTOA_SIMD_* value.  Returns NULL if the requested
+// instruction set is not available, JTOA_SIMD_AUTO picks the best one.
+const Kernels* jtoa_select_kernels(int simd);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef JTOA_SOURCE_H
+#define JTOA_SOURCE_H
+
+#include <stddef.h>
+
+#include "jtoa.h"
+
+// What a decoder reports about the image it decodes, for the steps of a
+// conversion shared by all formats
+typedef struct Decoded_ {
+	const char *format;
+	int image_width;
+	int image_height;
+	// components in the file, and of the decoded scanlines
+	int num_components;
+	int components;
+	int progressive;
+	// size of the decoded scanlines, scaled by scale_num/scale_denom
+	int output_width;
+	int output_height;
+	int scale_num;
+	int scale_denom;
+	// scan shown of a progressive JPEG preview, else 0
+	int preview_scan;
+} Decoded;
+
+// A decoder of a format besides JPEG, which libjtoa.c decodes itself.
+// Providers read from memory, the caller loads FILE sources first.  On
+// errors the functions taking ctx set ctx->error and return nonzero.
+typedef struct Provider_ {
+	const char *name;
+	// whether the size bytes at data start with the format's signature
+	int (*match)(const unsigned char *data, size_t size);
+	// Read the header into the format, image size, file components and
+	// progressive fields of d, and create the decoder in *handle
+	int (*open)(jtoa_ctx *ctx, const unsigned char *data, size_t size, void **handle, Decoded *d);
+	// Start decoding, to gray or RGB as ctx asks for, and with dct_scale
+	// to the smallest size the format can scale the whole image to that
+	// is not below max_width x max_height.  Sets the remaining fields of d.
+	int (*start)(jtoa_ctx *ctx, void *handle, int max_width, int max_height, Decoded *d);
+	// Decode the next count scanlines, top to bottom.  rows point to
+	// buffers for count scanlines that the decoder may fill, or it may
+	// point them at its own, valid until the next call.  Returns the
+	// number of scanlines decoded, or -1 on errors.
+	int (*read)(jtoa_ctx *ctx, void *handle, unsigned char **rows, int count);
+	void (*close)(void *handle);
+} Provider;
+
+// Greatest common divisor, for providers reducing their scale fraction
+int jtoa_gcd(int a, int b);
+
+#ifdef HAVE_PNG
+extern const Provider jtoa_png_provider;
+#endif
+#ifdef HAVE_WEBP
+extern const Provider jtoa_webp_provider;
+#endif
+
+#endif
@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "jtoa_util.h"
+
+double jtoa_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int jtoa_read_file(FILE *fp, unsigned char **data, size_t *capacity, size_t *size) {
+	*size = 0;
+	for ( ;; ) {
+		if ( *size == *capacity ) {
+			const size_t grown = *capacity ? 2 * *capacity : 1 << 16;
+			unsigned char *buf = (unsigned char*) realloc(*data, grown);
+			if ( buf == NULL )
+				return JTOA_READ_NO_MEMORY;
+			*data = buf;
+			*capacity = grown;
+		}
+		const size_t r = fread(*data + *size, 1, *capacity - *size, fp);
+		*size += r;
+		if ( r == 0 )
+			break;
+	}
+	return ferror(fp) ? JTOA_READ_ERROR : 0;
+}
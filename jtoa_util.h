@@ -0,0 +1,22 @@
+#ifndef JTOA_UTIL_H
+#define JTOA_UTIL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Helpers shared by libjtoa and the jtoa command
+
+// Seconds of the monotonic clock, for timing stages
+double jtoa_now(void);
+
+// Failures of jtoa_read_file
+#define JTOA_READ_NO_MEMORY 1
+#define JTOA_READ_ERROR 2
+
+// Read all of fp into the malloced buffer *data of *capacity bytes,
+// doubling it as needed, and set *size to the bytes read.  Returns 0, or
+// JTOA_READ_NO_MEMORY or JTOA_READ_ERROR.  The buffer is kept on failure
+// too, for the caller to free or reuse.
+int jtoa_read_file(FILE *fp, unsigned char **data, size_t *capacity, size_t *size);
+
+#endif
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <webp/decode.h>
+
+#include "jtoa.h"
+#include "jtoa_source.h"
+
+typedef struct Webp_ {
+	WebPDecoderConfig config;
+	const unsigned char *data;
+	size_t size;
+	int decoded;
+	int row;
+} Webp;
+
+static int webp_match(const unsigned char *data, const size_t size) {
+	return size >= 12 && !memcmp(data, "RIFF", 4) && !memcmp(data + 8, "WEBP", 4);
+}
+
+static void webp_close(void *handle) {
+	Webp *w = (Webp*) handle;
+	if ( w->decoded )
+		WebPFreeDecBuffer(&w->config.output);
+	free(w);
+}
+
+static int webp_open(jtoa_ctx *ctx, const unsigned char *data, const size_t size, void **handle, Decoded *d) {
+	Webp *w = (Webp*) calloc(1, sizeof(Webp));
+
+	if ( w == NULL ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Not enough memory");
+		return JTOA_ERROR;
+	}
+	if ( !WebPInitDecoderConfig(&w->config) ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Incompatible libwebp version");
+		free(w);
+		return JTOA_ERROR;
+	}
+	if ( WebPGetFeatures(data, size, &w->config.input) != VP8_STATUS_OK ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Invalid WebP header");
+		free(w);
+		return JTOA_ERROR;
+	}
+	w->data = data;
+	w->size = size;
+
+	d->format = "WebP";
+	d->image_width = w->config.input.width;
+	d->image_height = w->config.input.height;
+	d->num_components = w->config.input.has_alpha ? 4 : 3;
+	d->progressive = 0;
+	*handle = w;
+	return 0;
+}
+
+// libwebp scales while decoding to any size, so unlike libjpeg's n/8
+// factors, pick the smallest size of the image's aspect ratio that is not
+// below max_width x max_height
+static void select_scale(WebPDecoderConfig *config, const int max_width, const int max_height) {
+	const int width = config->input.width, height = config->input.height;
+	int w = max_width, h = (int) (((long) max_width * height + width - 1) / width);
+
+	if ( h < max_height ) {
+		h = max_height;
+		w = (int) (((long) max_height * width + height - 1) / height);
+	}
+	if ( w < width && h < height ) {
+		config->options.use_scaling = 1;
+		config->options.scaled_width = w > 0 ? w : 1;
+		config->options.scaled_height = h > 0 ? h : 1;
+	}
+}
+
+static int webp_start(jtoa_ctx *ctx, void *handle, const int max_width, const int max_height, Decoded *d) {
+	Webp *w = (Webp*) handle;
+	WebPDecoderConfig *config = &w->config;
+
+	if ( ctx->dct_scale )
+		select_scale(config, max_width, max_height);
+	// the Y plane is the luminance, as it is for JPEGs
+	config->output.colorspace = ctx->color || ctx->luma_average ? MODE_RGB : MODE_YUV;
+
+	const VP8StatusCode status = WebPDecode(w->data, w->size, config);
+	if ( status != VP8_STATUS_OK ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Can't decode WebP image (status %d)", (int) status);
+		return JTOA_ERROR;
+	}
+	w->decoded = 1;
+
+	d->components = config->output.colorspace == MODE_RGB ? 3 : 1;
+	d->output_width = config->output.width;
+	d->output_height = config->output.height;
+	const int g = jtoa_gcd(d->output_width, d->image_width);
+	d->scale_num = d->output_width / g;
+	d->scale_denom = d->image_width / g;
+	return 0;
+}
+
+// WebP's Y plane has the video range 16 to 235 of its YUV conversion
+static void expand_luma(const unsigned char *y, unsigned char *out, const int width) {
+	int x;
+	for ( x=0; x < width; ++x ) {
+		const int v = ((y[x] - 16) * 255 + 109) / 219;
+		out[x] = v < 0 ? 0 : v > 255 ? 255 : v;
+	}
+}
+
+static int webp_read(jtoa_ctx *ctx, void *handle, unsigned char **rows, const int count) {
+	Webp *w = (Webp*) handle;
+	const WebPDecBuffer *out = &w->config.output;
+	int r;
+
+	(void) ctx;
+	for ( r=0; r < count; ++r ) {
+		const size_t y = w->row + r;
+		if ( out->colorspace == MODE_RGB )
+			rows[r] = out->u.RGBA.rgba + y * out->u.RGBA.stride;
+		else
+			expand_luma(out->u.YUVA.y + y * out->u.YUVA.y_stride, rows[r], out->width);
+	}
+	w->row += count;
+	return count;
+}
+
+const Provider jtoa_webp_provider = { "WebP", webp_match, webp_open, webp_start, webp_read, webp_close };
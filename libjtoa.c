@@ -0,0 +1,1853 @@
+#include <stdio.h>
+#include "jpeglib.h"
+#include <setjmp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jtoa.h"
+#include "jtoa_simd.h"
+#include "jtoa_color.h"
+#include "jtoa_source.h"
+#include "jtoa_util.h"
+
+#define ROUND(x) (int) ( 0.5f + x )
+
+// libjpeg-turbo 1.5 and later can skip scanlines without fully decoding them
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+#define HAVE_SKIP_SCANLINES 1
+#endif
+
+#if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+#define HAVE_MEM_SRC 1
+#endif
+
+struct Image_;
+
+// Resample a decoded scanline to one row of output cells, each the sum of
+// the raw samples of the source pixels it covers
+typedef void (*ResampleFn)(const JSAMPLE *scanline, const struct Image_ *i, uint32_t *out);
+// Render the accumulated image as text, see render_image.  Returns the
+// size of the text.
+typedef size_t (*RenderFn)(const jtoa_ctx *ctx, const struct Image_ *i, char *frame);
+
+typedef struct Image_ {
+	int width;
+	int height;
+	// sums of raw samples over all components of the accumulated pixels
+	uint32_t *pixel;
+	int *yadds;
+	int lasty;
+	// output row of pixel[0] and yadds[0], for the partial images of bands
+	int first_row;
+	int components;
+	float resize_y;
+	float resize_x;
+	int *lookup_resx;
+	// leading columns whose lookup_resx leaves 4 bytes to the region's end,
+	// for gathering kernels
+	int gather_width;
+	// source region (in decoded pixels) relative to the decoded scanlines
+	int src_x;
+	int src_y;
+	int src_width;
+	int src_height;
+	// area-average horizontal filter, only allocated for --filter=box.
+	// Spans are byte offsets into the source region of the scanline, and
+	// box_sum its prefix sum.
+	int *box_start;
+	int *box_end;
+	uint32_t *box_weight;
+	uint32_t *box_sum;
+	// the current scanline resampled to output width
+	uint32_t *row;
+	// with color, sums of each channel of the accumulated pixels as three
+	// planes of width cells per row, and the current scanline's
+	uint32_t *color;
+	uint32_t *color_row;
+	// rendering scratch rows: quantised levels of an image row, error
+	// diffusion rows and the masks of a line of sub-cell glyphs
+	unsigned char *levels;
+	int *dither;
+	unsigned char *masks;
+	// variants specialised for the image, picked by init_image.
+	// resample_color is NULL without color.
+	ResampleFn resample;
+	ResampleFn resample_color;
+	RenderFn render;
+	const Kernels *kernels;
+	// rendered output, height lines of width chars and a newline.  Only
+	// allocated when not rendering into a caller's buffer, and handed over
+	// to the caller.
+	char *frame;
+	// allocated sizes in bytes, the buffers above only ever grow
+	size_t pixel_cap;
+	size_t yadds_cap;
+	size_t lookup_resx_cap;
+	size_t box_start_cap;
+	size_t box_end_cap;
+	size_t box_weight_cap;
+	size_t box_sum_cap;
+	size_t row_cap;
+	size_t color_cap;
+	size_t color_row_cap;
+	size_t levels_cap;
+	size_t dither_cap;
+	size_t masks_cap;
+} Image;
+
+// Where to read the JPEG from, either fp or size bytes at data
+typedef struct Source_ {
+	FILE *fp;
+	const unsigned char *data;
+	size_t size;
+} Source;
+
+// Calculate the output size of a jpeg_width x jpeg_height source into
+// *out_width and *out_height, starting from width and height.  With
+// auto_width or auto_height, that one is calculated from the other.
+static void calc_aspect_ratio(const int width, const int height, const int auto_width, const int auto_height,
+	const int jpeg_width, const int jpeg_height, int *out_width, int *out_height)
+{
+	int w = width, h = height;
+
+	// Calculate width or height, but not both
+	if ( auto_width && !auto_height ) {
+		w = ROUND(2.0f * (float) h * (float) jpeg_width / (float) jpeg_height);
+		// adjust for too small dimensions
+		while ( w==0 ) {
+			++h;
+			w = ROUND(2.0f * (float) h * (float) jpeg_width / (float) jpeg_height);
+		}
+	}
+	if ( !auto_width && auto_height ) {
+		h = ROUND(0.5f * (float) w * (float) jpeg_height / (float) jpeg_width);
+		// adjust for too small dimensions
+		while ( h==0 ) {
+			++w;
+			h = ROUND(0.5f * (float) w * (float) jpeg_height / (float) jpeg_width);
+		}
+	}
+	*out_width = w;
+	*out_height = h;
+}
+
+#define GLYPH_LUT_MAX (JTOA_LUT_SIZE - 1)
+
+// 32.32 fixed point factor mapping cell sums in [0, max] to [0, GLYPH_LUT_MAX]
+#define LUT_SCALE(max) ((max) ? ((uint64_t) GLYPH_LUT_MAX << 32) / (max) : 0)
+// Rounded LUT index of sum v.  v is clamped to max, which bounds the index
+// by GLYPH_LUT_MAX since max * scale <= GLYPH_LUT_MAX << 32.
+#define LUT_INDEX(v, max, scale) \
+	(int) (((uint64_t) ((v) < (max) ? (v) : (max)) * (scale) + 0x80000000u) >> 32)
+
+// 32.32 fixed point reciprocal of the rows accumulated into a color cell,
+// and the rounded average of a channel sum of those rows.  With 16 bits
+// the reciprocal of tall spans lost several percent.
+#define AVERAGE_SCALE(rows) ((rows) ? ((uint64_t) 1 << 32) / (rows) : 0)
+#define AVERAGE(sum, scale) (uint32_t) (((uint64_t) (sum) * (scale) + 0x80000000u) >> 32)
+
+// Resolve palette, palette length and invert for every quantised intensity
+static void init_glyph_lut(jtoa_ctx *ctx) {
+	const int chars = (int) strlen(ctx->ascii_palette) - 1;
+	int q;
+	for ( q=0; q <= GLYPH_LUT_MAX; ++q ) {
+		const int pos = (2 * chars * q + GLYPH_LUT_MAX) / (2 * GLYPH_LUT_MAX);
+		ctx->glyph_lut[q] = ctx->ascii_palette[ !ctx->invert ? chars - pos : pos ];
+	}
+}
+
+// Render the image as height lines of width chars plus newline into frame.
+// Instantiated per FLIPX so that the inner loop is a plain forward or
+// backward store.
+#define DEFINE_RENDER(name, FLIPX) \
+static size_t name(const jtoa_ctx *ctx, const Image* i, char *frame) { \
+	int x, y; \
+	const int w = i->width; \
+	const int h = i->height; \
+	\
+	for ( y=0; y < h; ++y ) { \
+		char *line = frame + y * (w + 1); \
+		char *out = !(FLIPX) ? line : line + w - 1; \
+		const int sy = !ctx->flipy? y : h-y-1; \
+		const uint32_t *src = &i->pixel[sy * w]; \
+		/* maximum possible sum of this row's cells */ \
+		const uint64_t max = (uint64_t) i->yadds[sy] * 255 * i->components; \
+		const uint64_t scale = LUT_SCALE(max); \
+		\
+		for ( x=0; x < w; ++x ) \
+			out[ !(FLIPX) ? x : -x ] = ctx->glyph_lut[ LUT_INDEX(src[x], max, scale) ]; \
+		\
+		line[w] = '\n'; \
+	} \
+	return (size_t) (w + 1) * h; \
+}
+
+DEFINE_RENDER(render_image, 0)
+DEFINE_RENDER(render_image_flipx, 1)
+
+// Sub-cell glyph modes: the pixels of a cell, the bit of each pixel in
+// the mask of set pixels, and the codepoint drawing each mask, or NULL for
+// braille patterns at U+2800 + mask.  Empty cells are spaces.
+typedef struct GlyphMode_ {
+	const char *name;
+	int width;
+	int height;
+	unsigned char bit[4][2];
+	const uint16_t *codes;
+} GlyphMode;
+
+static const uint16_t halfblock_codes[4] = { ' ', 0x2580, 0x2584, 0x2588 };
+static const uint16_t quadrant_codes[16] = {
+	' ', 0x2598, 0x259D, 0x2580, 0x2596, 0x258C, 0x259E, 0x259B,
+	0x2597, 0x259A, 0x2590, 0x259C, 0x2584, 0x2599, 0x259F, 0x2588
+};
+
+static const GlyphMode glyph_modes[] = {
+	{ "ascii", 1, 1, { { 0 } }, NULL },
+	{ "halfblock", 1, 2, { { 0 }, { 1 } }, halfblock_codes },
+	{ "quadrant", 2, 2, { { 0, 1 }, { 2, 3 } }, quadrant_codes },
+	{ "braille", 2, 4, { { 0, 3 }, { 1, 4 }, { 2, 5 }, { 6, 7 } }, NULL },
+};
+
+// UTF-8 length of the block and braille chars
+#define GLYPH_BYTES 3
+
+// Largest frame of width x height chars
+static size_t frame_bound(const jtoa_ctx *ctx, const int width, const int height) {
+	if ( !ctx->color && !ctx->glyphs )
+		return (size_t) (width + 1) * height;
+	const size_t cell = (ctx->glyphs ? GLYPH_BYTES : 1) + (ctx->color ? COLOR_ESCAPE_MAX : 0);
+	return ((size_t) width * cell + (ctx->color ? COLOR_RESET_LEN : 0) + 1) * height;
+}
+
+// 4x4 ordered dither thresholds, in sixteenths of a quantisation step
+static const unsigned char bayer[4][4] = {
+	{  0,  8,  2, 10 },
+	{ 12,  4, 14,  6 },
+	{  3, 11,  1,  9 },
+	{ 15,  7, 13,  5 },
+};
+
+// Quantise the normalised intensities of image row sy to levels + 1 steps
+// from black to white, in source order, rounding as the glyph LUT does or
+// with the dither of ctx.  y is the row's index in rendering order, which
+// error diffusion must visit one row after the other from 0.
+static void quantize_row(const jtoa_ctx *ctx, const Image* i, const int sy, const int y,
+	const int levels, unsigned char *out)
+{
+	const int w = i->width;
+	const uint32_t *src = &i->pixel[sy * w];
+	const uint64_t max = (uint64_t) i->yadds[sy] * 255 * i->components;
+	const uint64_t scale = LUT_SCALE(max);
+	int x;
+
+	switch ( ctx->dither ) {
+	case JTOA_DITHER_BAYER: {
+		// threshold offsets of this row, centred on zero
+		int offset[4];
+		for ( x=0; x < 4; ++x )
+			offset[x] = (2 * bayer[y & 3][x] + 1 - 16) * GLYPH_LUT_MAX / (32 * levels);
+		for ( x=0; x < w; ++x ) {
+			int v = LUT_INDEX(src[x], max, scale) + offset[x & 3];
+			v = v < 0 ? 0 : v;
+			v = v > GLYPH_LUT_MAX ? GLYPH_LUT_MAX : v;
+			out[x] = (2 * levels * v + GLYPH_LUT_MAX) / (2 * GLYPH_LUT_MAX);
+		}
+		break;
+	}
+	case JTOA_DITHER_FLOYD: {
+		// errors pushed into this row and the next one, with a cell of
+		// margin on both sides
+		int *cur = i->dither + (y & 1) * (w + 2), *next = i->dither + (~y & 1) * (w + 2);
+		if ( y == 0 )
+			memset(cur, 0, (w + 2) * sizeof(int));
+		memset(next, 0, (w + 2) * sizeof(int));
+		for ( x=0; x < w; ++x ) {
+			int v = LUT_INDEX(src[x], max, scale) + cur[x+1];
+			v = v < 0 ? 0 : v;
+			v = v > GLYPH_LUT_MAX ? GLYPH_LUT_MAX : v;
+			const int pos = (2 * levels * v + GLYPH_LUT_MAX) / (2 * GLYPH_LUT_MAX);
+			const int e = v - (pos * GLYPH_LUT_MAX + levels / 2) / levels;
+			cur[x+2] += e * 7 / 16;
+			next[x] += e * 3 / 16;
+			next[x+1] += e * 5 / 16;
+			next[x+2] += e / 16;
+			out[x] = pos;
+		}
+		break;
+	}
+	default:
+		for ( x=0; x < w; ++x )
+			out[x] = (2 * levels * LUT_INDEX(src[x], max, scale) + GLYPH_LUT_MAX) / (2 * GLYPH_LUT_MAX);
+		break;
+	}
+}
+
+// Char of quantised level pos, as in init_glyph_lut
+#define PALETTE_CHAR(ctx, chars, pos) (ctx)->ascii_palette[ !(ctx)->invert ? (chars) - (pos) : (pos) ]
+
+// Render as render_image, through quantize_row for dithering
+static size_t render_dithered(const jtoa_ctx *ctx, const Image* i, char *frame) {
+	const int chars = (int) strlen(ctx->ascii_palette) - 1;
+	const int w = i->width;
+	const int h = i->height;
+	int x, y;
+
+	for ( y=0; y < h; ++y ) {
+		char *line = frame + y * (w + 1);
+		quantize_row(ctx, i, !ctx->flipy ? y : h-y-1, y, chars, i->levels);
+		for ( x=0; x < w; ++x )
+			line[ !ctx->flipx ? x : w-x-1 ] = PALETTE_CHAR(ctx, chars, i->levels[x]);
+		line[w] = '\n';
+	}
+	return (size_t) (w + 1) * h;
+}
+
+// Render the cells of the glyph mode of ctx, each pixel set where it
+// quantises to black (white with invert).  With color each char gets the
+// average color of its cell, as in render_color.
+static size_t render_glyphs(const jtoa_ctx *ctx, const Image* i, char *frame) {
+	const GlyphMode *m = &glyph_modes[ctx->glyphs];
+	const unsigned char *lut = jtoa_color_lut(ctx->color);
+	const int w = i->width;
+	const int cols = w / m->width, lines = i->height / m->height;
+	const int pixels = m->width * m->height;
+	unsigned char *masks = i->masks;
+	char *out = frame;
+	int x, y, dx, dy;
+
+	for ( y=0; y < lines; ++y ) {
+		// collect the set pixels of each cell one image row at a time
+		const uint32_t *red[4];
+		uint64_t average[4];
+		memset(masks, 0, cols);
+		for ( dy=0; dy < m->height; ++dy ) {
+			const int row = y * m->height + dy;
+			const int sy = !ctx->flipy ? row : i->height - row - 1;
+			quantize_row(ctx, i, sy, row, 1, i->levels);
+			for ( x=0; x < w; ++x ) {
+				const int ox = !ctx->flipx ? x : w - x - 1;
+				if ( i->levels[x] == (unsigned char) !!ctx->invert )
+					masks[ox / m->width] |= 1 << m->bit[dy][ox % m->width];
+			}
+			if ( i->resample_color ) {
+				red[dy] = &i->color[(size_t) sy * 3 * w];
+				average[dy] = AVERAGE_SCALE(i->yadds[sy]);
+			}
+		}
+		uint32_t last = UINT32_MAX;
+
+		for ( x=0; x < cols; ++x ) {
+			const int mask = masks[x];
+			if ( !mask ) {
+				*out++ = ' ';
+				continue;
+			}
+			if ( i->resample_color ) {
+				uint32_t r = 0, g = 0, b = 0;
+				for ( dy=0; dy < m->height; ++dy ) {
+					for ( dx=0; dx < m->width; ++dx ) {
+						int sx = x * m->width + dx;
+						if ( ctx->flipx ) sx = w - sx - 1;
+						r += AVERAGE(red[dy][sx], average[dy]);
+						g += AVERAGE(red[dy][w + sx], average[dy]);
+						b += AVERAGE(red[dy][2*w + sx], average[dy]);
+					}
+				}
+				r = COLOR_CLAMP(r / pixels);
+				g = COLOR_CLAMP(g / pixels);
+				b = COLOR_CLAMP(b / pixels);
+				const uint32_t code = lut ? lut[COLOR_LUT_INDEX(r, g, b)] : r << 16 | g << 8 | b;
+				if ( code != last ) {
+					out += jtoa_color_escape(ctx->color, code, out);
+					last = code;
+				}
+			}
+			const unsigned c = m->codes ? m->codes[mask] : 0x2800 + mask;
+			*out++ = 0xE0 | c >> 12;
+			*out++ = 0x80 | (c >> 6 & 0x3F);
+			*out++ = 0x80 | (c & 0x3F);
+		}
+		if ( last != UINT32_MAX ) {
+			memcpy(out, COLOR_RESET, COLOR_RESET_LEN);
+			out += COLOR_RESET_LEN;
+		}
+		*out++ = '\n';
+	}
+	return out - frame;
+}
+
+// Render as render_image, with an escape before each char whose color
+// differs from the last one on its line.  Spaces show no color, so they
+// keep the last one.  Lines with escapes end in a reset.
+static size_t render_color(const jtoa_ctx *ctx, const Image* i, char *frame) {
+	const unsigned char *lut = jtoa_color_lut(ctx->color);
+	const int chars = (int) strlen(ctx->ascii_palette) - 1;
+	const int w = i->width;
+	const int h = i->height;
+	char *out = frame;
+	int x, y;
+
+	for ( y=0; y < h; ++y ) {
+		const int sy = !ctx->flipy? y : h-y-1;
+		const uint32_t *red = &i->color[(size_t) sy * 3 * w], *green = red + w, *blue = green + w;
+		const uint64_t average = AVERAGE_SCALE(i->yadds[sy]);
+		uint32_t last = UINT32_MAX;
+
+		quantize_row(ctx, i, sy, y, chars, i->levels);
+		for ( x=0; x < w; ++x ) {
+			const int sx = !ctx->flipx ? x : w-x-1;
+			const char c = PALETTE_CHAR(ctx, chars, i->levels[sx]);
+
+			if ( c != ' ' ) {
+				const uint32_t r = COLOR_CLAMP(AVERAGE(red[sx], average));
+				const uint32_t g = COLOR_CLAMP(AVERAGE(green[sx], average));
+				const uint32_t b = COLOR_CLAMP(AVERAGE(blue[sx], average));
+				const uint32_t code = lut ? lut[COLOR_LUT_INDEX(r, g, b)] : r << 16 | g << 8 | b;
+				if ( code != last ) {
+					out += jtoa_color_escape(ctx->color, code, out);
+					last = code;
+				}
+			}
+			*out++ = c;
+		}
+		if ( last != UINT32_MAX ) {
+			memcpy(out, COLOR_RESET, COLOR_RESET_LEN);
+			out += COLOR_RESET_LEN;
+		}
+		*out++ = '\n';
+	}
+	return out - frame;
+}
+
+static void clear(Image* i) {
+	memset(i->pixel, 0, i->width * i->height * sizeof(uint32_t));
+	memset(i->yadds, 0, i->height * sizeof(int) );
+	i->lasty = 0;
+	i->first_row = 0;
+}
+
+static void print_info(const jtoa_ctx *ctx, const Decoded *d, const Image* i) {
+	fprintf(stderr, "Source format: %s\n", d->format);
+	fprintf(stderr, "Source width: %d\n", d->image_width);
+	fprintf(stderr, "Source height: %d\n", d->image_height);
+	fprintf(stderr, "DCT scale: %d/%d (decoded %dx%d)\n", d->scale_num, d->scale_denom,
+		d->output_width, d->output_height);
+	if ( ctx->crop )
+		fprintf(stderr, "Source region: %dx%d at %d,%d\n", ctx->crop_width, ctx->crop_height,
+			ctx->crop_x, ctx->crop_y);
+	fprintf(stderr, "Source color components: %d\n", d->components);
+	if ( d->preview_scan )
+		fprintf(stderr, "Preview: scan %d\n", d->preview_scan);
+	fprintf(stderr, "Output width: %d\n", i->width / glyph_modes[ctx->glyphs].width);
+	fprintf(stderr, "Output height: %d\n", i->height / glyph_modes[ctx->glyphs].height);
+	if ( ctx->glyphs )
+		fprintf(stderr, "Glyphs: %s (%dx%d pixels per char)\n", glyph_modes[ctx->glyphs].name,
+			glyph_modes[ctx->glyphs].width, glyph_modes[ctx->glyphs].height);
+	fprintf(stderr, "Accumulation kernels: %s\n", ctx->kernels->name);
+	if ( ctx->color && d->components == 3 )
+		fprintf(stderr, "Output colors: %s\n", ctx->color == JTOA_COLOR_TRUECOLOR ? "truecolor" :
+			ctx->color == JTOA_COLOR_256 ? "256" : "16");
+	fprintf(stderr, "Output palette (%d chars): '%s'\n\n", (int) strlen(ctx->ascii_palette),
+		ctx->ascii_palette);
+}
+
+static uint32_t intensity(const JSAMPLE* source, const int components) {
+	uint32_t v = source[0];
+
+	int c=1;
+	while ( c < components )
+		v += source[c++];
+
+	return v;
+}
+
+// Nearest neighbour resampling.  Instantiated for the common component
+// counts so that intensity() is unrolled; COMPONENTS 0 reads the count
+// from the image.
+#define DEFINE_RESAMPLE(name, COMPONENTS) \
+static void name(const JSAMPLE *scanline, const Image *i, uint32_t *out) { \
+	const int components = (COMPONENTS) ? (COMPONENTS) : i->components; \
+	int x = i->kernels->gather ? \
+		i->kernels->gather(scanline, i->lookup_resx, components, i->gather_width, out) : 0; \
+	for ( ; x < i->width; ++x ) \
+		out[x] = intensity( &scanline[ i->lookup_resx[x] ], components); \
+}
+
+DEFINE_RESAMPLE(resample_nearest, 0)
+DEFINE_RESAMPLE(resample_nearest_1, 1)
+DEFINE_RESAMPLE(resample_nearest_3, 3)
+DEFINE_RESAMPLE(resample_nearest_4, 4)
+
+// Sum each column's span as the difference of two prefix sums, so a row
+// costs one pass over the region plus one subtraction per column
+static void resample_box(const JSAMPLE *scanline, const Image *i, uint32_t *out) {
+	i->kernels->prefix_sum(&scanline[ i->src_x * i->components ], i->src_width * i->components, i->box_sum);
+	i->kernels->box_row(i->box_sum, i->box_start, i->box_end, i->box_weight, i->width, out);
+}
+
+// Resample the channels of an RGB scanline into three planes of out
+static void resample_color_nearest(const JSAMPLE *scanline, const Image *i, uint32_t *out) {
+	const int w = i->width;
+	int x;
+	for ( x=0; x < w; ++x ) {
+		const JSAMPLE *p = &scanline[ i->lookup_resx[x] ];
+		out[x] = p[0];
+		out[w + x] = p[1];
+		out[2*w + x] = p[2];
+	}
+}
+
+static void resample_color_box(const JSAMPLE *scanline, const Image *i, uint32_t *out) {
+	const JSAMPLE *region = &scanline[ i->src_x * 3 ];
+	const int w = i->width;
+	int x, b;
+	for ( x=0; x < w; ++x ) {
+		uint32_t r = 0, g = 0, bl = 0;
+		for ( b=i->box_start[x]; b < i->box_end[x]; b += 3 ) {
+			r += region[b];
+			g += region[b+1];
+			bl += region[b+2];
+		}
+		out[x] = WEIGH(r, i->box_weight[x]);
+		out[w + x] = WEIGH(g, i->box_weight[x]);
+		out[2*w + x] = WEIGH(bl, i->box_weight[x]);
+	}
+}
+
+// Accumulate a block of count scanlines, the first being source row first
+static void process_scanlines(JSAMPARRAY rows, const int first, const int count, Image* i) {
+	int lasty = i->lasty;
+	int r;
+
+	for ( r=0; r < count; ++r ) {
+		// a single source row fills all output rows
+		const int y = i->src_height > 1 ?
+			ROUND( i->resize_y * (float) (first + r - i->src_y) ) : i->height - 1;
+		i->resample(rows[r], i, i->row);
+		if ( i->resample_color )
+			i->resample_color(rows[r], i, i->color_row);
+		// include all scanlines since last call
+		while ( lasty <= y ) {
+			i->kernels->accumulate(&i->pixel[(lasty - i->first_row) * i->width], i->row, i->width);
+			if ( i->resample_color )
+				i->kernels->accumulate(&i->color[(size_t) (lasty - i->first_row) * 3 * i->width],
+					i->color_row, 3 * i->width);
+			++i->yadds[lasty++ - i->first_row];
+		}
+		lasty = y;
+	}
+	i->lasty = lasty;
+}
+
+static void skip_scanlines(struct jpeg_decompress_struct *jpg, JSAMPARRAY buffer, int count) {
+#ifdef HAVE_SKIP_SCANLINES
+	jpeg_skip_scanlines(jpg, count);
+#else
+	// decode and discard; still saves the accumulation
+	while ( count-- > 0 )
+		jpeg_read_scanlines(jpg, buffer, 1);
+#endif
+}
+
+// Decode only the source row nearest to each output row and skip the rest.
+// Only used when the output has fewer rows than the source.
+static void sample_scanlines(struct jpeg_decompress_struct *jpg, JSAMPARRAY buffer, Image* i) {
+	const float step = i->height > 1 ?
+		(float) (i->src_height - 1) / (float) (i->height - 1) : 0.0f;
+	int y;
+
+	for ( y=0; y < i->height; ++y ) {
+		const int src = i->src_y + ROUND( step * (float) y );
+
+		if ( src > (int) jpg->output_scanline )
+			skip_scanlines(jpg, buffer, src - jpg->output_scanline);
+		jpeg_read_scanlines(jpg, buffer, 1);
+
+		i->resample(buffer[0], i, &i->pixel[y * i->width]);
+		if ( i->resample_color )
+			i->resample_color(buffer[0], i, &i->color[(size_t) y * 3 * i->width]);
+		i->yadds[y] = 1;
+	}
+}
+
+static void free_image(Image* i) {
+	if ( i->pixel ) free(i->pixel);
+	if ( i->yadds ) free(i->yadds);
+	if ( i->lookup_resx ) free(i->lookup_resx);
+	if ( i->box_start ) free(i->box_start);
+	if ( i->box_end ) free(i->box_end);
+	if ( i->box_weight ) free(i->box_weight);
+	if ( i->box_sum ) free(i->box_sum);
+	if ( i->row ) free(i->row);
+	if ( i->color ) free(i->color);
+	if ( i->color_row ) free(i->color_row);
+	if ( i->levels ) free(i->levels);
+	if ( i->dither ) free(i->dither);
+	if ( i->masks ) free(i->masks);
+	if ( i->frame ) free(i->frame);
+}
+
+// Grow *buf to hold at least size bytes.  The contents are not preserved.
+static int reserve_buffer(void **buf, size_t *capacity, const size_t size) {
+	if ( size <= *capacity )
+		return 0;
+	free(*buf);
+	if ( (*buf = malloc(size)) == NULL ) {
+		*capacity = 0;
+		return JTOA_ERROR;
+	}
+	*capacity = size;
+	return 0;
+}
+
+#define RESERVE(buf, count) reserve_buffer((void**) &(buf), &(buf##_cap), (count) * sizeof(*(buf)))
+
+// Make room for a width x height image, reusing the buffers of earlier
+// images where they are large enough.  Returns nonzero and sets ctx->error
+// if out of memory.
+static int reserve_image(jtoa_ctx *ctx, Image* i, const int width, const int height, const size_t frame_size) {
+	i->width = width;
+	i->height = height;
+
+	if ( RESERVE(i->pixel, (size_t) width * height) ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Not enough memory for given output dimension");
+		return JTOA_ERROR;
+	}
+
+	if ( RESERVE(i->yadds, height) ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Not enough memory for given output dimension (for yadds)");
+		return JTOA_ERROR;
+	}
+
+	if ( RESERVE(i->lookup_resx, width) || RESERVE(i->row, width) ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Not enough memory for given output dimension (lookup_resx)");
+		return JTOA_ERROR;
+	}
+
+	if ( frame_size && (i->frame = (char*) malloc(frame_size)) == NULL ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Not enough memory for given output dimension (frame)");
+		return JTOA_ERROR;
+	}
+	return 0;
+}
+
+// Precompute the bytes [box_start, box_end) of the source region covered by
+// each output column, and the reciprocal of its length in pixels, see
+// BOX_WEIGHT_BITS.
+static int init_box_filter(jtoa_ctx *ctx, Image *i) {
+	const int w = i->width;
+
+	if ( RESERVE(i->box_start, w) || RESERVE(i->box_end, w) || RESERVE(i->box_weight, w) ||
+	     RESERVE(i->box_sum, (size_t) i->src_width * i->components + 1) ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Not enough memory for given output dimension (box filter)");
+		return JTOA_ERROR;
+	}
+
+	int dst_x;
+	for ( dst_x=0; dst_x < w; ++dst_x ) {
+		int start = (long) dst_x * i->src_width / w;
+		int end = (long) (dst_x + 1) * i->src_width / w;
+		// when upscaling, a column may fall inside a single source pixel
+		if ( end <= start ) end = start + 1;
+		if ( end > i->src_width ) { end = i->src_width; start = end - 1; }
+
+		i->box_start[dst_x] = start * i->components;
+		i->box_end[dst_x] = end * i->components;
+		i->box_weight[dst_x] = (1 << BOX_WEIGHT_BITS) / (end - start);
+	}
+	return 0;
+}
+
+// src_x, src_y, src_width and src_height must be set before calling this.
+// returns nonzero and sets ctx->error if out of memory
+static int init_image(jtoa_ctx *ctx, Image *i, const int components) {
+	i->components = components;
+	i->resize_y = i->src_height > 1 ? (float) (i->height - 1) / (float) (i->src_height-1) : 0.0f;
+	i->resize_x = (float) i->src_width / (float) i->width;
+
+	int dst_x;
+	for ( dst_x=0; dst_x < i->width; ++dst_x ) {
+		i->lookup_resx[dst_x] = i->src_x + (int)( (float) dst_x * i->resize_x );
+		i->lookup_resx[dst_x] *= components;
+	}
+	const int region_end = (i->src_x + i->src_width) * components;
+	for ( i->gather_width = i->width; i->gather_width > 0; --i->gather_width )
+		if ( i->lookup_resx[i->gather_width - 1] + 4 <= region_end )
+			break;
+
+	i->kernels = (const Kernels*) ctx->kernels;
+	i->render = ctx->flipx ? render_image_flipx : render_image;
+	i->resample_color = NULL;
+
+	if ( ctx->color && i->components == 3 ) {
+		if ( RESERVE(i->color, (size_t) i->width * i->height * 3) || RESERVE(i->color_row, i->width * 3) ) {
+			snprintf(ctx->error, JTOA_ERROR_SIZE, "Not enough memory for given output dimension (color)");
+			return JTOA_ERROR;
+		}
+		memset(i->color, 0, (size_t) i->width * i->height * 3 * sizeof(uint32_t));
+		i->render = render_color;
+		i->resample_color = ctx->box_filter ? resample_color_box : resample_color_nearest;
+	}
+	if ( ctx->glyphs )
+		i->render = render_glyphs;
+	else if ( ctx->dither && !i->resample_color )
+		i->render = render_dithered;
+	if ( i->render != render_image && i->render != render_image_flipx &&
+	     (RESERVE(i->levels, i->width) || RESERVE(i->dither, 2 * (i->width + 2)) || RESERVE(i->masks, i->width)) )
+	{
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Not enough memory for given output dimension (render)");
+		return JTOA_ERROR;
+	}
+
+	if ( ctx->box_filter ) {
+		i->resample = resample_box;
+		return init_box_filter(ctx, i);
+	}
+	switch ( i->components ) {
+	case 1: i->resample = resample_nearest_1; break;
+	case 3: i->resample = resample_nearest_3; break;
+	case 4: i->resample = resample_nearest_4; break;
+	default: i->resample = resample_nearest; break;
+	}
+	return 0;
+}
+
+// Pick the smallest n/8 DCT scaling that still decodes at least width x height
+// pixels of a src_width x src_height region.  Older libjpegs round unsupported
+// factors up to the next one they know (1/8, 1/4, 1/2), so checking the
+// computed dimensions works for both.
+static void select_dct_scale(struct jpeg_decompress_struct *jpg, const int src_width, const int src_height,
+	const int width, const int height)
+{
+	int n;
+	for ( n=1; n <= 8; ++n ) {
+		jpg->scale_num = n;
+		jpg->scale_denom = 8;
+		jpeg_calc_output_dimensions(jpg);
+		if ( (long) jpg->output_width * src_width >= (long) width * jpg->image_width &&
+		     (long) jpg->output_height * src_height >= (long) height * jpg->image_height )
+			break;
+	}
+	// reduce fraction for print_info
+	while ( jpg->scale_num % 2 == 0 && jpg->scale_denom % 2 == 0 ) {
+		jpg->scale_num /= 2;
+		jpg->scale_denom /= 2;
+	}
+}
+
+// Start the output of progressive JPEGs after preview_scans scans, or
+// after the last scan if there are fewer.  Decoding the rest of the file
+// is left out by aborting the decompressor afterwards.
+static void start_preview(const jtoa_ctx *ctx, struct jpeg_decompress_struct *jpg) {
+	int r = JPEG_REACHED_SOS;
+	// scan input_scan_number has started, the rows read from it finish it
+	while ( jpg->input_scan_number < ctx->preview_scans && r != JPEG_REACHED_EOI && r != JPEG_SUSPENDED )
+		r = jpeg_consume_input(jpg);
+	jpeg_start_output(jpg, jpg->input_scan_number);
+}
+
+// libjpeg error manager that reports errors through the context instead of
+// exiting
+typedef struct ErrorMgr_ {
+	struct jpeg_error_mgr pub;
+	jmp_buf jump;
+	// JTOA_ERROR_SIZE bytes for the message
+	char *error;
+} ErrorMgr;
+
+static void error_exit(j_common_ptr cinfo) {
+	ErrorMgr *err = (ErrorMgr*) cinfo->err;
+	(*cinfo->err->format_message)(cinfo, err->error);
+	longjmp(err->jump, 1);
+}
+
+// Batches of scanlines in flight between the decoding and the accumulating
+// thread of a pipelined conversion
+#define PIPE_DEPTH 4
+
+typedef struct Pipeline_ {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	JSAMPARRAY rows[PIPE_DEPTH];
+	int first[PIPE_DEPTH];
+	int count[PIPE_DEPTH];
+	// batches are filled and taken in ring order
+	int filled;
+	int next;
+	int done;
+	int running;
+	Image *images;
+	int image_count;
+} Pipeline;
+
+// Decoder and buffers kept alive across the images converted by a context
+struct jtoa_state_ {
+	struct jpeg_decompress_struct jpg;
+	ErrorMgr jerr;
+	// whether jpg has been created, and which kind of source it reads
+	int created;
+	int source_type;
+	// one per output width, images[0] for a single output
+	Image images[JTOA_MAX_WIDTHS];
+	Pipeline pipe;
+	// scanline batches decoded by providers, and streams loaded for them
+	unsigned char *scanlines;
+	JSAMPROW *scanline_rows;
+	unsigned char *input;
+	size_t scanlines_cap;
+	size_t scanline_rows_cap;
+	size_t input_cap;
+};
+
+#define SOURCE_STDIO 1
+#define SOURCE_MEM 2
+
+static jtoa_state* get_state(jtoa_ctx *ctx) {
+	if ( !ctx->state ) {
+		// zeroed pointers and capacities make an empty image
+		if ( (ctx->state = (jtoa_state*) calloc(1, sizeof(jtoa_state))) == NULL ) {
+			snprintf(ctx->error, JTOA_ERROR_SIZE, "Not enough memory");
+			return NULL;
+		}
+		ctx->state->jpg.err = jpeg_std_error(&ctx->state->jerr.pub);
+		ctx->state->jerr.pub.error_exit = error_exit;
+	}
+	return ctx->state;
+}
+
+// Accumulate the batches decoded by the pipeline's main thread
+static void* pipeline_worker(void *arg) {
+	Pipeline *p = (Pipeline*) arg;
+	int n;
+
+	for ( ;; ) {
+		pthread_mutex_lock(&p->lock);
+		while ( !p->filled && !p->done )
+			pthread_cond_wait(&p->changed, &p->lock);
+		if ( !p->filled ) {
+			pthread_mutex_unlock(&p->lock);
+			return NULL;
+		}
+		const int b = p->next;
+		pthread_mutex_unlock(&p->lock);
+
+		for ( n=0; n < p->image_count; ++n )
+			process_scanlines(p->rows[b], p->first[b], p->count[b], &p->images[n]);
+
+		pthread_mutex_lock(&p->lock);
+		p->next = (b + 1) % PIPE_DEPTH;
+		--p->filled;
+		pthread_cond_signal(&p->changed);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+// Wait for the accumulating thread to finish the batches handed to it
+static void stop_pipeline(Pipeline *p) {
+	if ( !p->running )
+		return;
+	pthread_mutex_lock(&p->lock);
+	p->done = 1;
+	pthread_cond_signal(&p->changed);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->changed);
+	p->running = 0;
+}
+
+// Decode scanlines up to last while another thread accumulates them.
+// libjpeg stays on the calling thread, so its errors still reach the
+// caller's setjmp, which must call stop_pipeline.  Returns nonzero if the
+// thread can't be started.
+static int pipeline_scanlines(struct jpeg_decompress_struct *jpg, Pipeline *p, const int last,
+	const int rows, Image *images, const int image_count)
+{
+	const int row_stride = jpg->output_width * jpg->output_components;
+	int b;
+
+	for ( b=0; b < PIPE_DEPTH; ++b )
+		p->rows[b] = (*jpg->mem->alloc_sarray)((j_common_ptr) jpg, JPOOL_IMAGE, row_stride, rows);
+	p->filled = p->next = p->done = 0;
+	p->images = images;
+	p->image_count = image_count;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->changed, NULL);
+	if ( pthread_create(&p->thread, NULL, pipeline_worker, p) != 0 ) {
+		pthread_mutex_destroy(&p->lock);
+		pthread_cond_destroy(&p->changed);
+		return JTOA_ERROR;
+	}
+	p->running = 1;
+
+	for ( b=0; (int) jpg->output_scanline < last; b = (b + 1) % PIPE_DEPTH ) {
+		pthread_mutex_lock(&p->lock);
+		while ( p->filled == PIPE_DEPTH )
+			pthread_cond_wait(&p->changed, &p->lock);
+		pthread_mutex_unlock(&p->lock);
+
+		const int first = jpg->output_scanline;
+		p->count[b] = jpeg_read_scanlines(jpg, p->rows[b], last - first < rows ? last - first : rows);
+		p->first[b] = first;
+
+		pthread_mutex_lock(&p->lock);
+		++p->filled;
+		pthread_cond_signal(&p->changed);
+		pthread_mutex_unlock(&p->lock);
+	}
+	stop_pipeline(p);
+	return 0;
+}
+
+// A band of MCU rows between restart markers, decoded as a JPEG of its own
+// on its own thread into a partial image of the output rows it touches
+typedef struct Band_ {
+	pthread_t thread;
+	const struct jpeg_decompress_struct *main;
+	unsigned char *data;
+	size_t size;
+	// first decoded scanline of the band in the whole image
+	int first;
+	int rows;
+	Image image;
+	int status;
+	char error[JTOA_ERROR_SIZE];
+} Band;
+
+static void* decode_band(void *arg) {
+	Band *b = (Band*) arg;
+	struct jpeg_decompress_struct jpg;
+	ErrorMgr jerr;
+
+	jpg.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = error_exit;
+	jerr.error = b->error;
+	if ( setjmp(jerr.jump) ) {
+		jpeg_destroy_decompress(&jpg);
+		b->status = JTOA_ERROR;
+		return NULL;
+	}
+	jpeg_create_decompress(&jpg);
+	jpeg_mem_src(&jpg, b->data, b->size);
+	jpeg_read_header(&jpg, TRUE);
+
+	// decode exactly like the whole image
+	jpg.out_color_space = b->main->out_color_space;
+	jpg.scale_num = b->main->scale_num;
+	jpg.scale_denom = b->main->scale_denom;
+	jpeg_start_decompress(&jpg);
+
+	const int rows = b->rows > jpg.rec_outbuf_height ? b->rows : jpg.rec_outbuf_height;
+	JSAMPARRAY buffer = (*jpg.mem->alloc_sarray)((j_common_ptr) &jpg, JPOOL_IMAGE,
+		jpg.output_width * jpg.output_components, rows);
+
+	while ( jpg.output_scanline < jpg.output_height ) {
+		const int first = jpg.output_scanline;
+		const int count = jpeg_read_scanlines(&jpg, buffer, rows);
+		process_scanlines(buffer, b->first + first, count, &b->image);
+	}
+	jpeg_finish_decompress(&jpg);
+	jpeg_destroy_decompress(&jpg);
+	b->status = 0;
+	return NULL;
+}
+
+int jtoa_gcd(int a, int b) {
+	while ( b ) { const int t = a % b; a = b; b = t; }
+	return a;
+}
+
+// Where the entropy coded data of a baseline JPEG starts, and the offsets
+// of its restart markers.  Returns nonzero if the file can't be split.
+typedef struct Restarts_ {
+	size_t sof;
+	size_t entropy;
+	size_t end;
+	size_t *markers;
+	size_t count;
+} Restarts;
+
+static int find_restarts(const unsigned char *data, const size_t size, Restarts *r) {
+	size_t pos = 2, capacity = 0;
+
+	memset(r, 0, sizeof(Restarts));
+	for ( ;; ) {
+		if ( pos + 4 > size || data[pos] != 0xFF )
+			return JTOA_ERROR;
+		const int marker = data[pos+1];
+		const size_t len = data[pos+2] << 8 | data[pos+3];
+		if ( marker == 0xC0 || marker == 0xC1 )
+			r->sof = pos;
+		else if ( marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xCC )
+			return JTOA_ERROR;
+		pos += 2 + len;
+		if ( marker == 0xDA )
+			break;
+	}
+	if ( !r->sof || pos > size )
+		return JTOA_ERROR;
+	r->entropy = pos;
+
+	for ( ; pos + 1 < size; ++pos ) {
+		const unsigned char *ff = (const unsigned char*) memchr(data + pos, 0xFF, size - 1 - pos);
+		if ( ff == NULL )
+			break;
+		pos = ff - data;
+		const int marker = data[pos+1];
+		if ( marker == 0 || marker == 0xFF )
+			continue;
+		if ( marker < 0xD0 || marker > 0xD7 )
+			break;
+		if ( r->count == capacity ) {
+			size_t *grown = (size_t*) realloc(r->markers, (capacity + 1024) * sizeof(size_t));
+			if ( grown == NULL )
+				return JTOA_ERROR;
+			r->markers = grown;
+			capacity += 1024;
+		}
+		r->markers[r->count++] = pos;
+	}
+	// anything but EOI after the scan, e.g. DNL, is not supported
+	if ( pos + 1 >= size || data[pos+1] != 0xD9 )
+		return JTOA_ERROR;
+	r->end = pos;
+	return 0;
+}
+
+// Decode a baseline JPEG with restart markers at the start of MCU rows in
+// bands on up to ctx->threads threads, in the same way as the serial
+// read loop would into image.  Returns -1 without decoding if the JPEG
+// can't be split like that, or nonzero with ctx->error set on errors.
+static int decode_bands(jtoa_ctx *ctx, const struct jpeg_decompress_struct *jpg, const Source *src,
+	Image *image)
+{
+	const unsigned char *data = src->data;
+	Restarts r;
+	int n, result = -1;
+
+	if ( !data || image->resample_color || jpg->restart_interval == 0 || jpeg_has_multiple_scans((j_decompress_ptr) jpg) )
+		return -1;
+	// bands can't share the rows chroma upsampling interpolates between
+	if ( jpg->out_color_space != JCS_GRAYSCALE && (jpg->max_h_samp_factor > 1 || jpg->max_v_samp_factor > 1) )
+		return -1;
+	if ( find_restarts(data, src->size, &r) ) {
+		free(r.markers);
+		return -1;
+	}
+
+	// MCU layout of the scan
+	int mcu_height, mcus_per_row, mcu_rows;
+	if ( jpg->comps_in_scan == 1 ) {
+		const jpeg_component_info *c = jpg->cur_comp_info[0];
+		const int w = (jpg->image_width * c->h_samp_factor + jpg->max_h_samp_factor - 1) / jpg->max_h_samp_factor;
+		const int h = (jpg->image_height * c->v_samp_factor + jpg->max_v_samp_factor - 1) / jpg->max_v_samp_factor;
+		mcu_height = 8 * jpg->max_v_samp_factor / c->v_samp_factor;
+		mcus_per_row = (w + 7) / 8;
+		mcu_rows = (h + 7) / 8;
+	} else {
+		mcu_height = 8 * jpg->max_v_samp_factor;
+		mcus_per_row = (jpg->image_width + 8 * jpg->max_h_samp_factor - 1) / (8 * jpg->max_h_samp_factor);
+		mcu_rows = (jpg->image_height + mcu_height - 1) / mcu_height;
+	}
+	const long interval = jpg->restart_interval;
+	const long intervals = ((long) mcus_per_row * mcu_rows + interval - 1) / interval;
+	if ( (long) r.count != intervals - 1 ) {
+		free(r.markers);
+		return -1;
+	}
+
+	// rows starting with a restart interval are step_rows apart
+	const int step_rows = interval / jtoa_gcd(interval, mcus_per_row);
+	const int steps = (mcu_rows + step_rows - 1) / step_rows;
+	const int bands = ctx->threads < steps ? ctx->threads : steps;
+	if ( bands < 2 ) {
+		free(r.markers);
+		return -1;
+	}
+
+	Band *band = (Band*) calloc(bands, sizeof(Band));
+	if ( band == NULL ) {
+		free(r.markers);
+		return -1;
+	}
+
+	for ( n=0; n < bands; ++n ) {
+		Band *b = &band[n];
+		// MCU rows and restart intervals of the band
+		const int row0 = (long) steps * n / bands * step_rows;
+		int row1 = (long) steps * (n + 1) / bands * step_rows;
+		if ( row1 > mcu_rows ) row1 = mcu_rows;
+		const long k0 = (long) row0 * mcus_per_row / interval;
+		const long k1 = n + 1 < bands ? (long) row1 * mcus_per_row / interval : intervals;
+		const size_t start = k0 ? r.markers[k0-1] + 2 : r.entropy;
+		const size_t end = k1 < intervals ? r.markers[k1-1] : r.end;
+		int height = (row1 - row0) * mcu_height;
+		if ( row0 * mcu_height + height > (int) jpg->image_height )
+			height = jpg->image_height - row0 * mcu_height;
+
+		// headers with the band's height, its entropy coded data with
+		// restart markers numbered from 0, and EOI
+		b->size = r.entropy + (end - start) + 2;
+		if ( (b->data = (unsigned char*) malloc(b->size)) == NULL )
+			goto cleanup;
+		memcpy(b->data, data, r.entropy);
+		b->data[r.sof + 5] = height >> 8;
+		b->data[r.sof + 6] = height & 0xFF;
+		memcpy(b->data + r.entropy, data + start, end - start);
+		long k;
+		for ( k = k0; k < k1 - 1; ++k )
+			b->data[r.entropy + r.markers[k] - start + 1] = 0xD0 + ((k - k0) & 7);
+		b->data[b->size - 2] = 0xFF;
+		b->data[b->size - 1] = 0xD9;
+
+		// the band's scanlines add to output rows y(first - 1) to y(last)
+		b->main = jpg;
+		b->first = (long) row0 * mcu_height * jpg->scale_num / jpg->scale_denom;
+		const int last = n + 1 < bands ?
+			(long) row1 * mcu_height * jpg->scale_num / jpg->scale_denom - 1 : (int) jpg->output_height - 1;
+		b->rows = ctx->batch_rows;
+		b->image = *image;
+		b->image.first_row = b->first ? ROUND( image->resize_y * (float) (b->first - 1) ) : 0;
+		b->image.lasty = b->image.first_row;
+		const int out_rows = ROUND( image->resize_y * (float) last ) - b->image.first_row + 1;
+		b->image.pixel = (uint32_t*) calloc((size_t) out_rows * image->width, sizeof(uint32_t));
+		b->image.yadds = (int*) calloc(out_rows, sizeof(int));
+		b->image.row = (uint32_t*) malloc(image->width * sizeof(uint32_t));
+		// the box filter's prefix sums are scratch space of each thread
+		const int box = image->resample == resample_box;
+		b->image.box_sum = box ? (uint32_t*) malloc(image->box_sum_cap) : NULL;
+		b->image.height = out_rows;
+		if ( !b->image.pixel || !b->image.yadds || !b->image.row || (box && !b->image.box_sum) )
+			goto cleanup;
+	}
+
+	int started;
+	for ( started=0; started < bands; ++started )
+		if ( pthread_create(&band[started].thread, NULL, decode_band, &band[started]) != 0 )
+			break;
+	for ( n=0; n < started; ++n )
+		pthread_join(band[n].thread, NULL);
+
+	result = 0;
+	for ( n=0; n < bands; ++n ) {
+		Band *b = &band[n];
+		if ( n >= started || b->status != 0 ) {
+			if ( n >= started )
+				snprintf(ctx->error, JTOA_ERROR_SIZE, "Can't create band decoding threads");
+			else
+				memcpy(ctx->error, b->error, JTOA_ERROR_SIZE);
+			result = JTOA_ERROR;
+			break;
+		}
+		// bands only share the rows at their edges
+		const int first_row = b->image.first_row;
+		int y, x;
+		for ( y=0; y < b->image.height && first_row + y < image->height; ++y ) {
+			uint32_t *dst = &image->pixel[(first_row + y) * image->width];
+			const uint32_t *src_row = &b->image.pixel[y * image->width];
+			for ( x=0; x < image->width; ++x )
+				dst[x] += src_row[x];
+			image->yadds[first_row + y] += b->image.yadds[y];
+		}
+	}
+
+cleanup:
+	for ( n=0; n < bands; ++n ) {
+		free(band[n].data);
+		free(band[n].image.pixel);
+		free(band[n].image.yadds);
+		free(band[n].image.row);
+		free(band[n].image.box_sum);
+	}
+	free(band);
+	free(r.markers);
+	return result;
+}
+
+// Add the time since mark to a stage of ctx->timings if it is set
+#define LAP(stage) \
+	if ( ctx->timings ) { \
+		const double t = jtoa_now(); \
+		ctx->timings->stage += t - mark; \
+		mark = t; \
+	}
+
+// Source region and output sizes of a conversion, shared by all formats
+typedef struct Layout_ {
+	int images;
+	// source region in image pixels
+	int src_x;
+	int src_y;
+	int src_width;
+	int src_height;
+	int out_width[JTOA_MAX_WIDTHS];
+	int out_height[JTOA_MAX_WIDTHS];
+	// the largest output size in accumulated pixels, which is chars times
+	// the pixels per char of the glyph mode, for scaled decoding
+	int max_width;
+	int max_height;
+	// the region in decoded (possibly scaled) pixels
+	int dec_x;
+	int dec_y;
+	int dec_width;
+	int dec_height;
+} Layout;
+
+// Check the crop region against the image size, and calculate the output
+// sizes of the images, setting sizes[n] to the largest size of frame n.
+// Returns nonzero and sets ctx->error if the region is outside the image.
+static int layout_images(jtoa_ctx *ctx, const Decoded *d, const int *widths, const int images,
+	Layout *l, size_t *sizes)
+{
+	const GlyphMode *m = &glyph_modes[ctx->glyphs];
+	int n;
+
+	l->images = images;
+	l->src_x = 0; l->src_y = 0;
+	l->src_width = d->image_width; l->src_height = d->image_height;
+
+	if ( ctx->crop ) {
+		if ( ctx->crop_x + ctx->crop_width > l->src_width || ctx->crop_y + ctx->crop_height > l->src_height ) {
+			snprintf(ctx->error, JTOA_ERROR_SIZE, "Crop region %dx%d at %d,%d is outside of the %dx%d image",
+				ctx->crop_width, ctx->crop_height, ctx->crop_x, ctx->crop_y, l->src_width, l->src_height);
+			return JTOA_ERROR;
+		}
+		l->src_x = ctx->crop_x; l->src_y = ctx->crop_y;
+		l->src_width = ctx->crop_width; l->src_height = ctx->crop_height;
+	}
+
+	l->max_width = 0; l->max_height = 0;
+	for ( n=0; n < images; ++n ) {
+		if ( widths )
+			calc_aspect_ratio(widths[n], 0, 0, 1, l->src_width, l->src_height, &l->out_width[n], &l->out_height[n]);
+		else
+			calc_aspect_ratio(ctx->width, ctx->height, ctx->auto_width, ctx->auto_height,
+				l->src_width, l->src_height, &l->out_width[n], &l->out_height[n]);
+		if ( l->out_width[n] * m->width > l->max_width ) l->max_width = l->out_width[n] * m->width;
+		if ( l->out_height[n] * m->height > l->max_height ) l->max_height = l->out_height[n] * m->height;
+		sizes[n] = frame_bound(ctx, l->out_width[n], l->out_height[n]);
+	}
+	return 0;
+}
+
+static void fill_info(const Decoded *d, const Layout *l, jtoa_info *info) {
+	info->source_width = d->image_width;
+	info->source_height = d->image_height;
+	info->components = d->num_components;
+	info->progressive = d->progressive;
+	info->width = l->out_width[0];
+	info->height = l->out_height[0];
+}
+
+// Returns JTOA_BUFFER_TOO_SMALL and sets ctx->error if the first frame
+// does not fit into capacity bytes
+static int check_capacity(jtoa_ctx *ctx, const size_t *sizes, const size_t capacity) {
+	if ( sizes[0] > capacity ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Output buffer too small, %lu bytes needed",
+			(unsigned long) sizes[0]);
+		return JTOA_BUFFER_TOO_SMALL;
+	}
+	return 0;
+}
+
+// map the region to decoded pixels, once d has the decoded size
+static void layout_decoded(Layout *l, const Decoded *d) {
+	l->dec_x = (long) l->src_x * d->output_width / d->image_width;
+	l->dec_y = (long) l->src_y * d->output_height / d->image_height;
+	l->dec_width = (long) l->src_width * d->output_width / d->image_width;
+	l->dec_height = (long) l->src_height * d->output_height / d->image_height;
+	if ( l->dec_width < 1 ) l->dec_width = 1;
+	if ( l->dec_height < 1 ) l->dec_height = 1;
+}
+
+// Set up the images for the scanlines described by d.  Frames are
+// allocated unless rendering into dst.
+static int setup_images(jtoa_ctx *ctx, jtoa_state *state, const Layout *l, const Decoded *d,
+	const char *dst, const size_t *sizes)
+{
+	// sub-cell glyphs accumulate each of their pixels
+	const GlyphMode *m = &glyph_modes[ctx->glyphs];
+	int n;
+
+	for ( n=0; n < l->images; ++n ) {
+		Image *const image = &state->images[n];
+
+		image->src_x = l->dec_x;
+		image->src_y = l->dec_y;
+		image->src_width = l->dec_width;
+		image->src_height = l->dec_height;
+
+		if ( reserve_image(ctx, image, l->out_width[n] * m->width, l->out_height[n] * m->height,
+			dst ? 0 : sizes[n]) )
+			return JTOA_ERROR;
+		clear(image);
+
+		if ( ctx->verbose ) print_info(ctx, d, image);
+
+		if ( init_image(ctx, image, d->components) )
+			return JTOA_ERROR;
+	}
+	return 0;
+}
+
+// Render the accumulated images, setting sizes[n] to the size of each
+static void render_images(jtoa_ctx *ctx, jtoa_state *state, const Layout *l, char *dst, size_t *sizes) {
+	int n;
+	for ( n=0; n < l->images; ++n ) {
+		Image *const image = &state->images[n];
+		sizes[n] = image->render(ctx, image, dst ? dst : image->frame);
+	}
+}
+
+static void fill_stats(jtoa_ctx *ctx, const Decoded *d, const Layout *l, const int decoded) {
+	jtoa_stats *const s = ctx->stats;
+	int n;
+
+	s->source_width = d->image_width;
+	s->source_height = d->image_height;
+	s->decoded_width = d->output_width;
+	s->decoded_height = d->output_height;
+	s->scale_num = d->scale_num;
+	s->scale_denom = d->scale_denom;
+	s->scanlines_decoded = decoded;
+	s->scanlines_skipped = d->output_height - decoded;
+	for ( n=0; n < l->images; ++n )
+		s->cells += (long) l->out_width[n] * l->out_height[n];
+}
+
+static void free_frames(jtoa_state *state, const int images) {
+	int n;
+	for ( n=0; n < images; ++n ) {
+		if ( state->images[n].frame ) {
+			free(state->images[n].frame);
+			state->images[n].frame = NULL;
+		}
+	}
+}
+
+// Formats decoded by providers, matched against the data in order
+static const Provider *const providers[] = {
+#ifdef HAVE_PNG
+	&jtoa_png_provider,
+#endif
+#ifdef HAVE_WEBP
+	&jtoa_webp_provider,
+#endif
+	NULL
+};
+
+static const Provider* match_provider(const Source *src) {
+	int n;
+	for ( n=0; providers[n]; ++n )
+		if ( providers[n]->match(src->data, src->size) )
+			return providers[n];
+	return NULL;
+}
+
+// Read all of fp into the growing buffer *data.  Returns nonzero and sets
+// ctx->error if out of memory or on read errors.
+static int read_stream(jtoa_ctx *ctx, FILE *fp, unsigned char **data, size_t *capacity, size_t *size) {
+	const int r = jtoa_read_file(fp, data, capacity, size);
+	if ( r )
+		snprintf(ctx->error, JTOA_ERROR_SIZE, r == JTOA_READ_NO_MEMORY ? "Not enough memory for input" :
+			"Can't read input");
+	return r ? JTOA_ERROR : 0;
+}
+
+// Decode scanline batches from a provider, one thread accumulating them
+// into all images.  --fast and threads only apply to JPEGs.
+static int decompress_provider(jtoa_ctx *ctx, const Provider *p, const Source *src, jtoa_state *state,
+	const int *widths, const int count, char *dst, const size_t capacity, size_t *sizes,
+	jtoa_info *info)
+{
+	const int images = widths ? count : 1;
+	void *handle = NULL;
+	Decoded d;
+	Layout l;
+	int n, r;
+
+	double mark = ctx->timings ? jtoa_now() : 0;
+
+	memset(&d, 0, sizeof(Decoded));
+	if ( p->open(ctx, src->data, src->size, &handle, &d) )
+		return JTOA_ERROR;
+	if ( layout_images(ctx, &d, widths, images, &l, sizes) )
+		goto error;
+
+	if ( info ) {
+		fill_info(&d, &l, info);
+		p->close(handle);
+		return 0;
+	}
+	if ( dst && (r = check_capacity(ctx, sizes, capacity)) != 0 ) {
+		p->close(handle);
+		return r;
+	}
+
+	// the size the whole image must be decoded at for the region
+	const int need_width = ((long) l.max_width * d.image_width + l.src_width - 1) / l.src_width;
+	const int need_height = ((long) l.max_height * d.image_height + l.src_height - 1) / l.src_height;
+	if ( p->start(ctx, handle, need_width, need_height, &d) )
+		goto error;
+	layout_decoded(&l, &d);
+
+	const int rows = ctx->batch_rows;
+	const size_t row_stride = (size_t) d.output_width * d.components;
+	if ( RESERVE(state->scanlines, row_stride * rows) || RESERVE(state->scanline_rows, rows) ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Not enough memory for scanlines");
+		goto error;
+	}
+	if ( setup_images(ctx, state, &l, &d, dst, sizes) )
+		goto error;
+
+	LAP(header);
+
+	const int last = l.dec_y + l.dec_height;
+	int y = 0;
+	while ( y < last ) {
+		const int want = last - y < rows ? last - y : rows;
+		// the provider may point the rows at its own buffers
+		for ( n=0; n < want; ++n )
+			state->scanline_rows[n] = state->scanlines + n * row_stride;
+		const int got = p->read(ctx, handle, state->scanline_rows, want);
+		if ( got < 1 )
+			goto error;
+		LAP(decode);
+
+		// scanlines above the region are decoded and dropped
+		const int skip = l.dec_y > y ? (l.dec_y - y < got ? l.dec_y - y : got) : 0;
+		if ( skip < got )
+			for ( n=0; n < images; ++n )
+				process_scanlines(state->scanline_rows + skip, y + skip, got - skip, &state->images[n]);
+		y += got;
+		LAP(accumulate);
+	}
+
+	render_images(ctx, state, &l, dst, sizes);
+	LAP(render);
+
+	if ( ctx->stats )
+		fill_stats(ctx, &d, &l, l.dec_height);
+
+	p->close(handle);
+	return 0;
+
+error:
+	free_frames(state, images);
+	p->close(handle);
+	return JTOA_ERROR;
+}
+
+// Decode src and render it into the images' frames.  Without widths,
+// renders one image at the size given by the options, into dst if given.
+// Otherwise renders count images of the given widths.  sizes[n] is set to
+// the size of frame n, also if dst is too small to hold it.  With info,
+// only reads the header and fills in info.  On error returns nonzero and
+// sets ctx->error.
+static int decompress(jtoa_ctx *ctx, const Source *src, jtoa_state *state,
+	const int *widths, const int count, char *dst, const size_t capacity, size_t *sizes,
+	jtoa_info *info)
+{
+	struct jpeg_decompress_struct *const jpg = &state->jpg;
+	const int images = widths ? count : 1;
+	Source loaded;
+	int n, r;
+
+	for ( n=0; n < images; ++n )
+		state->images[n].frame = NULL;
+
+	if ( ctx->stats )
+		memset(ctx->stats, 0, sizeof(jtoa_stats));
+	double mark = 0;
+	if ( ctx->timings ) {
+		memset(ctx->timings, 0, sizeof(jtoa_timings));
+		mark = jtoa_now();
+	}
+
+	// JPEGs start with 0xFF, streams of other formats are loaded into
+	// memory for the providers to match
+	if ( providers[0] && src->fp ) {
+		const int c = getc(src->fp);
+		if ( c != EOF )
+			ungetc(c, src->fp);
+		if ( c != EOF && c != 0xFF ) {
+			loaded.fp = NULL;
+			loaded.data = NULL;
+			if ( read_stream(ctx, src->fp, &state->input, &state->input_cap, &loaded.size) )
+				return JTOA_ERROR;
+			loaded.data = state->input;
+			src = &loaded;
+		}
+	}
+	if ( providers[0] && !src->fp ) {
+		const Provider *p = match_provider(src);
+		if ( p )
+			return decompress_provider(ctx, p, src, state, widths, count, dst, capacity, sizes, info);
+	}
+
+	const int source_type = src->fp ? SOURCE_STDIO : SOURCE_MEM;
+
+	state->jerr.error = ctx->error;
+	if ( setjmp(state->jerr.jump) )
+		goto error;
+
+	// libjpeg refuses to switch a decompressor between source managers
+	if ( state->created && state->source_type != source_type ) {
+		jpeg_destroy_decompress(jpg);
+		state->created = 0;
+	}
+	if ( !state->created ) {
+		jpeg_create_decompress(jpg);
+		state->created = 1;
+		state->source_type = source_type;
+	}
+
+	if ( src->fp ) {
+		jpeg_stdio_src(jpg, src->fp);
+	} else {
+#ifdef HAVE_MEM_SRC
+		jpeg_mem_src(jpg, (unsigned char*) src->data, src->size);
+#else
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Reading from memory is not supported by this libjpeg");
+		goto error;
+#endif
+	}
+	jpeg_read_header(jpg, TRUE);
+
+	Decoded d;
+	memset(&d, 0, sizeof(Decoded));
+	d.format = "JPEG";
+	d.image_width = jpg->image_width;
+	d.image_height = jpg->image_height;
+	d.num_components = jpg->num_components;
+	d.progressive = jpeg_has_multiple_scans(jpg);
+
+	Layout l;
+	if ( layout_images(ctx, &d, widths, images, &l, sizes) )
+		goto error;
+
+	if ( info ) {
+		fill_info(&d, &l, info);
+		jpeg_abort_decompress(jpg);
+		return 0;
+	}
+
+	if ( dst && (r = check_capacity(ctx, sizes, capacity)) != 0 ) {
+		jpeg_abort_decompress(jpg);
+		return r;
+	}
+
+	// Only the Y plane is needed for luminance, so skip chroma upsampling
+	// and color conversion.  libjpeg can't do this from e.g. CMYK.
+	if ( ctx->color && (jpg->jpeg_color_space == JCS_YCbCr || jpg->jpeg_color_space == JCS_RGB) )
+		jpg->out_color_space = JCS_RGB;
+	else if ( !ctx->luma_average && jpg->jpeg_color_space == JCS_YCbCr )
+		jpg->out_color_space = JCS_GRAYSCALE;
+
+	if ( ctx->dct_scale ) select_dct_scale(jpg, l.src_width, l.src_height, l.max_width, l.max_height);
+
+	if ( ctx->preview_scans > 0 && jpeg_has_multiple_scans(jpg) )
+		jpg->buffered_image = TRUE;
+
+	jpeg_start_decompress(jpg);
+	if ( jpg->buffered_image )
+		start_preview(ctx, jpg);
+
+	d.components = jpg->output_components;
+	d.output_width = jpg->output_width;
+	d.output_height = jpg->output_height;
+	d.scale_num = jpg->scale_num;
+	d.scale_denom = jpg->scale_denom;
+	d.preview_scan = jpg->buffered_image ? jpg->output_scan_number : 0;
+	layout_decoded(&l, &d);
+
+#ifdef HAVE_SKIP_SCANLINES
+	// only decode the iMCU columns covering the region
+	if ( ctx->crop ) {
+		JDIMENSION xoffset = l.dec_x, xwidth = l.dec_width;
+		jpeg_crop_scanline(jpg, &xoffset, &xwidth);
+		l.dec_x -= xoffset;
+	}
+#endif
+
+	int row_stride = jpg->output_width * jpg->output_components;
+
+	int rows = ctx->batch_rows > jpg->rec_outbuf_height ? ctx->batch_rows : jpg->rec_outbuf_height;
+
+	JSAMPARRAY buffer = (*jpg->mem->alloc_sarray)
+		((j_common_ptr) jpg, JPOOL_IMAGE, row_stride, rows);
+
+	if ( setup_images(ctx, state, &l, &d, dst, sizes) )
+		goto error;
+
+	LAP(header);
+
+	const int dec_y = l.dec_y, dec_height = l.dec_height;
+	const int last = dec_y + dec_height;
+	const int sampled = ctx->fast_sampling && images == 1 && state->images[0].height < dec_height;
+	int parallel = -1;
+
+	// sampling picks the rows of one image
+	if ( sampled )
+		sample_scanlines(jpg, buffer, &state->images[0]);
+	else if ( ctx->threads > 1 && images == 1 && !ctx->crop && !jpg->buffered_image )
+		parallel = decode_bands(ctx, jpg, src, &state->images[0]);
+	if ( parallel > 0 )
+		goto error;
+	if ( ctx->verbose && ctx->threads > 1 )
+		fprintf(stderr, "Parallel decoding: %s\n\n", parallel == 0 ? "restart marker bands" :
+			sampled ? "none" : "pipelined");
+
+	if ( parallel == 0 ) {
+		// the bands decoded the whole image
+	} else if ( !sampled && ctx->threads > 1 ) {
+		if ( dec_y > 0 )
+			skip_scanlines(jpg, buffer, dec_y);
+		if ( pipeline_scanlines(jpg, &state->pipe, last, rows, state->images, images) ) {
+			snprintf(ctx->error, JTOA_ERROR_SIZE, "Can't create pipeline thread");
+			goto error;
+		}
+	} else {
+		if ( !sampled && dec_y > 0 )
+			skip_scanlines(jpg, buffer, dec_y);
+
+		// all images are accumulated from the same scanlines
+		while ( (int) jpg->output_scanline < last ) {
+			const int first = jpg->output_scanline;
+			const int count = jpeg_read_scanlines(jpg, buffer,
+				last - first < rows ? last - first : rows);
+			LAP(decode);
+			for ( n=0; n < images; ++n )
+				process_scanlines(buffer, first, count, &state->images[n]);
+			LAP(accumulate);
+		}
+	}
+	LAP(decode);
+
+	render_images(ctx, state, &l, dst, sizes);
+	LAP(render);
+
+	if ( ctx->stats )
+		fill_stats(ctx, &d, &l, sampled ? state->images[0].height : dec_height);
+
+	// the sampled path may stop before the last scanline, and previews
+	// before the last scan
+	if ( jpg->buffered_image || jpg->output_scanline < jpg->output_height )
+		jpeg_abort_decompress(jpg);
+	else
+		jpeg_finish_decompress(jpg);
+
+	return 0;
+
+error:
+	stop_pipeline(&state->pipe);
+	free_frames(state, images);
+	// resets the decompressor for the next image
+	if ( state->created )
+		jpeg_abort_decompress(jpg);
+	return JTOA_ERROR;
+}
+
+void jtoa_init(jtoa_ctx *ctx) {
+	memset(ctx, 0, sizeof(jtoa_ctx));
+	ctx->width = 78;
+	ctx->auto_height = 1;
+	ctx->batch_rows = 16;
+	ctx->threads = 1;
+	strcpy(ctx->ascii_palette, JTOA_DEFAULT_PALETTE);
+}
+
+int jtoa_prepare(jtoa_ctx *ctx) {
+	ctx->prepared = 0;
+
+	if ( strlen(ctx->ascii_palette) < 2 ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "You must specify at least two characters in --chars.");
+		return JTOA_ERROR;
+	}
+	if ( ctx->crop && (ctx->crop_x < 0 || ctx->crop_y < 0 || ctx->crop_width < 1 || ctx->crop_height < 1) ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Invalid crop region specified.");
+		return JTOA_ERROR;
+	}
+	if ( ctx->threads < 1 ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Invalid number of threads specified.");
+		return JTOA_ERROR;
+	}
+	if ( ctx->preview_scans < 0 ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Invalid number of preview scans specified.");
+		return JTOA_ERROR;
+	}
+	if ( ctx->color < JTOA_COLOR_NONE || ctx->color > JTOA_COLOR_16 ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Invalid color mode specified.");
+		return JTOA_ERROR;
+	}
+	if ( ctx->dither < JTOA_DITHER_NONE || ctx->dither > JTOA_DITHER_FLOYD ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Invalid dither mode specified.");
+		return JTOA_ERROR;
+	}
+	if ( ctx->glyphs < JTOA_GLYPHS_ASCII || ctx->glyphs > JTOA_GLYPHS_BRAILLE ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Invalid glyph mode specified.");
+		return JTOA_ERROR;
+	}
+	if ( ctx->batch_rows < 1 ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Invalid number of rows specified.");
+		return JTOA_ERROR;
+	}
+	if ( (ctx->width < 1 && !ctx->auto_width) || (ctx->height < 1 && !ctx->auto_height) ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Invalid width or height specified.");
+		return JTOA_ERROR;
+	}
+
+	if ( (ctx->kernels = jtoa_select_kernels(ctx->simd)) == NULL ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "The requested SIMD instruction set is not supported.");
+		return JTOA_ERROR;
+	}
+
+	init_glyph_lut(ctx);
+	ctx->prepared = 1;
+	return 0;
+}
+
+static int check_prepared(jtoa_ctx *ctx) {
+	if ( !ctx->prepared ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "jtoa_prepare has not been called");
+		return JTOA_ERROR;
+	}
+	return 0;
+}
+
+static int render_alloc(jtoa_ctx *ctx, const Source *source, char **dst_buf, size_t *dst_size) {
+	jtoa_state *state;
+	int r;
+
+	if ( (r = check_prepared(ctx)) != 0 )
+		return r;
+	if ( (state = get_state(ctx)) == NULL )
+		return JTOA_ERROR;
+	if ( (r = decompress(ctx, source, state, NULL, 1, NULL, 0, dst_size, NULL)) != 0 )
+		return r;
+
+	// hand the frame over to the caller
+	*dst_buf = state->images[0].frame;
+	state->images[0].frame = NULL;
+	return 0;
+}
+
+int jtoa_render(jtoa_ctx *ctx, FILE *src, char **dst_buf, size_t *dst_size) {
+	const Source source = { src, NULL, 0 };
+	return render_alloc(ctx, &source, dst_buf, dst_size);
+}
+
+int jtoa_render_buffer(jtoa_ctx *ctx, const void *src, const size_t src_size,
+	char **dst_buf, size_t *dst_size)
+{
+	const Source source = { NULL, (const unsigned char*) src, src_size };
+	return render_alloc(ctx, &source, dst_buf, dst_size);
+}
+
+int jtoa_render_mem(jtoa_ctx *ctx, const void *src, const size_t src_size,
+	char *dst, const size_t dst_capacity, size_t *dst_size)
+{
+	const Source source = { NULL, (const unsigned char*) src, src_size };
+	jtoa_state *state;
+	int r;
+
+	if ( (r = check_prepared(ctx)) != 0 )
+		return r;
+	if ( (state = get_state(ctx)) == NULL )
+		return JTOA_ERROR;
+	return decompress(ctx, &source, state, NULL, 1, dst, dst_capacity, dst_size, NULL);
+}
+
+static int render_widths(jtoa_ctx *ctx, const Source *source, const int *widths, const int count,
+	char **dst_bufs, size_t *dst_sizes)
+{
+	jtoa_state *state;
+	int r, n;
+
+	if ( (r = check_prepared(ctx)) != 0 )
+		return r;
+	if ( count < 1 || count > JTOA_MAX_WIDTHS ) {
+		snprintf(ctx->error, JTOA_ERROR_SIZE, "Between 1 and %d widths can be rendered at once", JTOA_MAX_WIDTHS);
+		return JTOA_ERROR;
+	}
+	for ( n=0; n < count; ++n ) {
+		if ( widths[n] < 1 ) {
+			snprintf(ctx->error, JTOA_ERROR_SIZE, "Invalid width %d specified.", widths[n]);
+			return JTOA_ERROR;
+		}
+	}
+	if ( (state = get_state(ctx)) == NULL )
+		return JTOA_ERROR;
+	if ( (r = decompress(ctx, source, state, widths, count, NULL, 0, dst_sizes, NULL)) != 0 )
+		return r;
+
+	for ( n=0; n < count; ++n ) {
+		dst_bufs[n] = state->images[n].frame;
+		state->images[n].frame = NULL;
+	}
+	return 0;
+}
+
+int jtoa_render_widths(jtoa_ctx *ctx, FILE *src, const int *widths, const int count,
+	char **dst_bufs, size_t *dst_sizes)
+{
+	const Source source = { src, NULL, 0 };
+	return render_widths(ctx, &source, widths, count, dst_bufs, dst_sizes);
+}
+
+int jtoa_render_widths_buffer(jtoa_ctx *ctx, const void *src, const size_t src_size,
+	const int *widths, const int count, char **dst_bufs, size_t *dst_sizes)
+{
+	const Source source = { NULL, (const unsigned char*) src, src_size };
+	return render_widths(ctx, &source, widths, count, dst_bufs, dst_sizes);
+}
+
+static int read_info(jtoa_ctx *ctx, const Source *source, jtoa_info *info) {
+	jtoa_state *state;
+	size_t size;
+	int r;
+
+	if ( (r = check_prepared(ctx)) != 0 )
+		return r;
+	if ( (state = get_state(ctx)) == NULL )
+		return JTOA_ERROR;
+	return decompress(ctx, source, state, NULL, 1, NULL, 0, &size, info);
+}
+
+int jtoa_read_info(jtoa_ctx *ctx, FILE *src, jtoa_info *info) {
+	const Source source = { src, NULL, 0 };
+	return read_info(ctx, &source, info);
+}
+
+int jtoa_read_info_buffer(jtoa_ctx *ctx, const void *src, const size_t src_size, jtoa_info *info) {
+	const Source source = { NULL, (const unsigned char*) src, src_size };
+	return read_info(ctx, &source, info);
+}
+
+void jtoa_copy(jtoa_ctx *dst, const jtoa_ctx *src) {
+	*dst = *src;
+	dst->state = NULL;
+	dst->timings = NULL;
+	dst->stats = NULL;
+}
+
+void jtoa_free(jtoa_ctx *ctx) {
+	int n;
+
+	if ( !ctx->state )
+		return;
+	if ( ctx->state->created )
+		jpeg_destroy_decompress(&ctx->state->jpg);
+	for ( n=0; n < JTOA_MAX_WIDTHS; ++n )
+		free_image(&ctx->state->images[n]);
+	free(ctx->state->scanlines);
+	free(ctx->state->scanline_rows);
+	free(ctx->state->input);
+	free(ctx->state);
+	ctx->state = NULL;
+}
+
@@ -0,0 +1,181 @@
+#!/bin/sh
+# Regression checks of jtoa, run by make check.  Generates its images
+# with mkjpeg and checks that
+#  - the --simd, --threads and --rows variants of a conversion give the
+#    same bytes as the scalar, single threaded one
+#  - box filtered, colored and cropped edge cases give the expected text
+#
+#   [PNG=1] [WEBP=1] tests/check.sh [JTOA [MKJPEG]]
+#
+# PNG and WebP images are checked when PNG or WEBP is 1, with mkpng and
+# mkwebp from the directory of MKJPEG.
+
+JTOA=${1:-./jtoa}
+MKJPEG=${2:-tests/mkjpeg}
+TOOLS=$(dirname "$MKJPEG")
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+failures=0
+checks=0
+
+fail() {
+	echo "FAIL: $*"
+	failures=$((failures + 1))
+}
+
+# expect NAME EXPECTED JTOA-ARGS...: the text of a conversion
+expect() {
+	name=$1
+	expected=$(printf "$2")
+	shift 2
+	checks=$((checks + 1))
+	actual=$("$JTOA" "$@" 2>&1) || { fail "$name: jtoa $* exited with $?"; return; }
+	[ "$actual" = "$expected" ] || fail "$name: jtoa $* printed '$actual', expected '$expected'"
+}
+
+# same FILE ARGS: every variant of the conversion matches the reference
+same() {
+	file=$1
+	shift
+	"$JTOA" --simd=scalar --threads=1 "$@" "$file" > "$TMP/ref" 2>&1 ||
+		{ fail "jtoa $* $file exited with $?"; return; }
+	for variant in $simds --threads=2 --threads=3 --rows=1 --rows=5 --rows=64 "--threads=4 --rows=7"; do
+		checks=$((checks + 1))
+		"$JTOA" $variant "$@" "$file" > "$TMP/out" 2>&1
+		cmp -s "$TMP/ref" "$TMP/out" || fail "jtoa $variant $* $file differs from --simd=scalar --threads=1"
+	done
+}
+
+set -e
+"$MKJPEG" 640x480 gradient 420 1 > "$TMP/r420.jpg"
+"$MKJPEG" 333x77 gradient 444 2 > "$TMP/r444.jpg"
+"$MKJPEG" 1000x700 gradient 422 0 progressive > "$TMP/prog.jpg"
+"$MKJPEG" 517x203 gradient gray 3 > "$TMP/gray.jpg"
+"$MKJPEG" 2000x200 white > "$TMP/white2k.jpg"
+"$MKJPEG" 8000x64 white > "$TMP/wide.jpg"
+"$MKJPEG" 8000x64 white 444 > "$TMP/widec.jpg"
+"$MKJPEG" 64x20000 white 444 > "$TMP/tall.jpg"
+"$MKJPEG" 300x1 white > "$TMP/row.jpg"
+"$MKJPEG" 40x40 white > "$TMP/white.jpg"
+if [ "$PNG" = 1 ]; then
+	"$TOOLS/mkpng" 300x200 white > "$TMP/white.png"
+	"$TOOLS/mkpng" 517x203 gradient rgb > "$TMP/rgb.png"
+	"$TOOLS/mkpng" 517x203 gradient rgb interlaced > "$TMP/interlaced.png"
+fi
+if [ "$WEBP" = 1 ]; then
+	"$TOOLS/mkwebp" 300x200 white > "$TMP/white.webp"
+	"$TOOLS/mkwebp" 1000x700 gradient 90 > "$TMP/lossy.webp"
+fi
+set +e
+
+# the instruction sets of this processor
+simds=
+for simd in sse2 avx2 neon; do
+	"$JTOA" --simd=$simd --width=2 "$TMP/white.jpg" > /dev/null 2>&1 && simds="$simds --simd=$simd"
+done
+echo "checking with --simd=scalar$simds"
+
+for image in r420 r444 prog gray; do
+	for options in "" -i --fast --filter=box --luma=average "--filter=box --luma=average" \
+		--flipx --flipy --dither=bayer --dither=floyd --width=200 "--size=1000x21" \
+		--color=truecolor "--color=256 --filter=box" "--color=16 --fast" \
+		--glyphs=halfblock "--glyphs=quadrant --dither=floyd" "--glyphs=braille --color=truecolor" \
+		"--crop=13,7,301x69 --width=55" "--crop=13,7,301x69 --filter=box --color=256" \
+		"--widths=10,78,201" --dct-scale
+	do
+		same "$TMP/$image.jpg" $options
+	done
+done
+
+# with --chars=.M white is '.' and black 'M', or the other way around with -i
+
+# a box spanning 4000 white pixels averages to white, not past it
+for simd in scalar $simds; do
+	simd=${simd#--simd=}
+	expect "wide white box" "..\n.." --simd=$simd --chars=.M --filter=box --size=2x2 "$TMP/wide.jpg"
+	expect "wide white box, default chars" "  \n  " --simd=$simd --filter=box --size=2x2 "$TMP/white2k.jpg"
+	expect "wide white box, 3 columns" "   " --simd=$simd --filter=box --size=3x1 "$TMP/white2k.jpg"
+	expect "wide white box, average" "..\n.." --simd=$simd --chars=.M --filter=box --luma=average --size=2x2 "$TMP/widec.jpg"
+	expect "wide white nearest" "......." --simd=$simd --chars=.M --size=7x1 "$TMP/wide.jpg"
+	expect "wide white box color" "\033[38;2;255;255;255m..\033[0m" --simd=$simd --chars=.M \
+		--filter=box --color=truecolor --size=2x1 "$TMP/widec.jpg"
+done
+
+# 20000 rows of white accumulate to white
+expect "tall white" "...." --chars=.M --luma=average --size=4x1 "$TMP/tall.jpg"
+expect "tall white box" "...." --chars=.M --luma=average --filter=box --size=4x1 "$TMP/tall.jpg"
+expect "tall white color" "\033[38;2;255;255;255m....\033[0m" --chars=.M --color=truecolor --size=4x1 "$TMP/tall.jpg"
+
+# cell colors are valid escapes of their palettes
+for color in truecolor 256 16; do
+	for options in "" --filter=box "--glyphs=braille" "--glyphs=quadrant --filter=box"; do
+		checks=$((checks + 1))
+		"$JTOA" -i --color=$color $options --width=9 "$TMP/widec.jpg" "$TMP/tall.jpg" "$TMP/r444.jpg" |
+			grep -o '\[[0-9;]*m' | tr '[;m' '   ' | tr ' ' '\n' | awk '$1 > 255 { bad = 1 } END { exit bad }' ||
+			fail "--color=$color $options printed a channel or palette index above 255"
+	done
+done
+expect "white truecolor" "\033[38;2;255;255;255mMM\033[0m" -i --chars=.M --color=truecolor --size=2x1 "$TMP/widec.jpg"
+expect "white 256" "\033[38;5;231mMM\033[0m" -i --chars=.M --color=256 --size=2x1 "$TMP/widec.jpg"
+expect "white 16" "\033[97mMM\033[0m" -i --chars=.M --color=16 --size=2x1 "$TMP/widec.jpg"
+
+# --dct-scale decodes enough pixels for the sub-cell pixels of glyphs, not
+# just for the chars: 78x27 braille chars have 156x108 pixels
+for options in "--glyphs=ascii 1/8" "--glyphs=braille 1/4" "--glyphs=quadrant --width=100 1/4"; do
+	checks=$((checks + 1))
+	scale=${options##* }
+	"$JTOA" -v --dct-scale ${options% *} "$TMP/prog.jpg" 2>&1 > /dev/null | grep -q "^DCT scale: $scale " ||
+		fail "jtoa -v --dct-scale ${options% *} did not pick DCT scale $scale"
+done
+
+# a single source row fills every output row
+expect "one row image" "...\n...\n..." --chars=.M --size=3x3 "$TMP/row.jpg"
+expect "one row image, box" "...\n...\n..." --chars=.M --filter=box --size=3x3 "$TMP/row.jpg"
+expect "one row crop" "....\n....\n....\n...." --chars=.M --crop=0,0,10x1 --size=4x4 "$TMP/white.jpg"
+expect "one row crop, fast" "....\n...." --chars=.M --fast --crop=5,39,10x1 --size=4x2 "$TMP/white.jpg"
+expect "one row crop, threads" "....\n...." --chars=.M --threads=2 --crop=0,20,10x1 --size=4x2 "$TMP/white.jpg"
+expect "one pixel crop" "..\n.." --chars=.M --crop=3,3,1x1 --size=2x2 "$TMP/white.jpg"
+
+# --stats of a cache hit reports no decode counters
+checks=$((checks + 1))
+"$JTOA" --cache="$TMP/cache" --stats=json "$TMP/r420.jpg" 2>&1 > /dev/null | grep -q '"cached": false, .*"dct_scale": "1/1"' &&
+	"$JTOA" --cache="$TMP/cache" --stats=json "$TMP/r420.jpg" 2>&1 > /dev/null |
+	grep -q '"cached": true, .*"dct_scale": null, .*"output_cells": null' ||
+	fail "--stats=json of a cache miss and then hit"
+
+# PNG: decoded to gray or RGB, interlaced images as non-interlaced ones
+if [ "$PNG" = 1 ]; then
+	expect "white PNG" "....\n...." --chars=.M --size=4x2 "$TMP/white.png"
+	expect "white PNG, average" "....\n...." --chars=.M --luma=average --size=4x2 "$TMP/white.png"
+	for options in "" --luma=average --filter=box --color=truecolor "--glyphs=braille --dither=floyd"; do
+		same "$TMP/rgb.png" $options
+		checks=$((checks + 1))
+		"$JTOA" $options "$TMP/rgb.png" > "$TMP/ref" 2>&1
+		"$JTOA" $options "$TMP/interlaced.png" > "$TMP/out" 2>&1
+		cmp -s "$TMP/ref" "$TMP/out" || fail "jtoa $options of an interlaced PNG differs from the plain one"
+	done
+fi
+
+# WebP: the luma plane expanded from video range, RGB, and the scale
+# libwebp decodes to with --dct-scale, reduced with jtoa_gcd
+if [ "$WEBP" = 1 ]; then
+	expect "white WebP" "....\n...." --chars=.M --size=4x2 "$TMP/white.webp"
+	expect "white WebP, average" "....\n...." --chars=.M --luma=average --size=4x2 "$TMP/white.webp"
+	expect "white WebP color" "\033[38;2;255;255;255mMMMM\033[0m" -i --chars=.M --color=truecolor --size=4x1 "$TMP/white.webp"
+	for options in "" --luma=average --filter=box --color=256 --dct-scale; do
+		same "$TMP/lossy.webp" $options
+	done
+	for options in "DCT scale: 1/1 (decoded 1000x700)" \
+		"--dct-scale DCT scale: 39/500 (decoded 78x55)" \
+		"--dct-scale --glyphs=braille DCT scale: 39/250 (decoded 156x110)"
+	do
+		checks=$((checks + 1))
+		args=${options%%DCT*}
+		scale=DCT${options#*DCT}
+		"$JTOA" -v $args "$TMP/lossy.webp" 2>&1 > /dev/null | grep -qF "$scale" ||
+			fail "jtoa -v $args of a 1000x700 WebP did not report '$scale'"
+	done
+fi
+
+echo "$checks checks, $failures failed"
+[ $failures -eq 0 ]
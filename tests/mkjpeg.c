@@ -0,0 +1,58 @@
+// Write generated JPEGs to stdout, for check.sh
+//
+//   mkjpeg WxH PATTERN [SAMPLING [RESTART [progressive]]]
+//
+// PATTERN is white, black, gray or gradient; SAMPLING 444, 422, 420 or
+// gray (the default); RESTART the restart interval in MCU rows, 0 for none.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jpeglib.h"
+
+#include "pattern.h"
+
+int main(int argc, char **argv) {
+	struct jpeg_compress_struct jpg;
+	struct jpeg_error_mgr jerr;
+	int width, height, y;
+
+	if ( argc < 3 || sscanf(argv[1], "%dx%d", &width, &height) != 2 || width < 1 || height < 1 ||
+	     !valid_pattern(argv[2]) ) {
+		fprintf(stderr, "Usage: mkjpeg WxH white|black|gray|gradient [444|422|420|gray [RESTART [progressive]]]\n");
+		return 1;
+	}
+	const char *pattern = argv[2];
+	const char *sampling = argc > 3 ? argv[3] : "gray";
+	const int restart = argc > 4 ? atoi(argv[4]) : 0;
+	const int progressive = argc > 5 && !strcmp(argv[5], "progressive");
+	const int gray = !strcmp(sampling, "gray");
+
+	jpg.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&jpg);
+	jpeg_stdio_dest(&jpg, stdout);
+	jpg.image_width = width;
+	jpg.image_height = height;
+	jpg.input_components = gray ? 1 : 3;
+	jpg.in_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+	jpeg_set_defaults(&jpg);
+	jpeg_set_quality(&jpg, 95, TRUE);
+	if ( !gray ) {
+		jpg.comp_info[0].h_samp_factor = strcmp(sampling, "444") ? 2 : 1;
+		jpg.comp_info[0].v_samp_factor = !strcmp(sampling, "420") ? 2 : 1;
+	}
+	jpg.restart_in_rows = restart;
+	if ( progressive )
+		jpeg_simple_progression(&jpg);
+	jpeg_start_compress(&jpg, TRUE);
+
+	unsigned char *row = (unsigned char*) malloc((size_t) width * 3);
+	for ( y=0; y < height; ++y ) {
+		fill_row(pattern, y, width, height, jpg.input_components, row);
+		JSAMPROW rows[1] = { row };
+		jpeg_write_scanlines(&jpg, rows, 1);
+	}
+	jpeg_finish_compress(&jpg);
+	jpeg_destroy_compress(&jpg);
+	free(row);
+	return 0;
+}
@@ -0,0 +1,49 @@
+// Write generated PNGs to stdout, for check.sh
+//
+//   mkpng WxH PATTERN [gray|rgb [interlaced]]
+//
+// PATTERN is white, black, gray or gradient, as for mkjpeg
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <png.h>
+
+#include "pattern.h"
+
+int main(int argc, char **argv) {
+	int width, height, y, pass;
+
+	if ( argc < 3 || sscanf(argv[1], "%dx%d", &width, &height) != 2 || width < 1 || height < 1 ||
+	     !valid_pattern(argv[2]) ) {
+		fprintf(stderr, "Usage: mkpng WxH white|black|gray|gradient [gray|rgb [interlaced]]\n");
+		return 1;
+	}
+	const char *pattern = argv[2];
+	const int components = argc > 3 && !strcmp(argv[3], "rgb") ? 3 : 1;
+	const int interlaced = argc > 4 && !strcmp(argv[4], "interlaced");
+
+	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info = png ? png_create_info_struct(png) : NULL;
+	if ( info == NULL || setjmp(png_jmpbuf(png)) ) {
+		fprintf(stderr, "Can't write PNG\n");
+		return 1;
+	}
+	png_init_io(png, stdout);
+	png_set_IHDR(png, info, width, height, 8, components == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_GRAY,
+		interlaced ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+		PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png, info);
+
+	unsigned char *row = (unsigned char*) malloc((size_t) width * 3);
+	const int passes = png_set_interlace_handling(png);
+	for ( pass=0; pass < passes; ++pass ) {
+		for ( y=0; y < height; ++y ) {
+			fill_row(pattern, y, width, height, components, row);
+			png_write_row(png, row);
+		}
+	}
+	png_write_end(png, info);
+	png_destroy_write_struct(&png, &info);
+	free(row);
+	return 0;
+}
@@ -0,0 +1,40 @@
+// Write generated WebPs to stdout, for check.sh
+//
+//   mkwebp WxH PATTERN [lossless|QUALITY]
+//
+// PATTERN is white, black, gray or gradient, as for mkjpeg.  Images are
+// lossless by default.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <webp/encode.h>
+
+#include "pattern.h"
+
+int main(int argc, char **argv) {
+	int width, height, y;
+
+	if ( argc < 3 || sscanf(argv[1], "%dx%d", &width, &height) != 2 || width < 1 || height < 1 ||
+	     !valid_pattern(argv[2]) ) {
+		fprintf(stderr, "Usage: mkwebp WxH white|black|gray|gradient [lossless|QUALITY]\n");
+		return 1;
+	}
+	const char *pattern = argv[2];
+	const int lossless = argc < 4 || !strcmp(argv[3], "lossless");
+
+	unsigned char *rgb = (unsigned char*) malloc((size_t) width * height * 3);
+	for ( y=0; y < height; ++y )
+		fill_row(pattern, y, width, height, 3, rgb + (size_t) y * width * 3);
+
+	uint8_t *out;
+	const size_t size = lossless ? WebPEncodeLosslessRGB(rgb, width, height, width * 3, &out) :
+		WebPEncodeRGB(rgb, width, height, width * 3, (float) atof(argv[3]), &out);
+	if ( size == 0 ) {
+		fprintf(stderr, "Can't encode WebP\n");
+		return 1;
+	}
+	fwrite(out, 1, size, stdout);
+	WebPFree(out);
+	free(rgb);
+	return 0;
+}
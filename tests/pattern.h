@@ -0,0 +1,29 @@
+#ifndef TESTS_PATTERN_H
+#define TESTS_PATTERN_H
+
+#include <string.h>
+
+// Pixels of the test image patterns shared by the mk* generators
+
+// Whether pattern is white, black, gray or gradient
+static int valid_pattern(const char *pattern) {
+	return !strcmp(pattern, "white") || !strcmp(pattern, "black") || !strcmp(pattern, "gray") ||
+		!strcmp(pattern, "gradient");
+}
+
+// Fill row y of a width x height image of 1 (gray) or 3 (RGB) components
+static void fill_row(const char *pattern, const int y, const int width, const int height,
+	const int components, unsigned char *row)
+{
+	int x;
+	for ( x=0; x < width * components; ++x ) {
+		const int px = x / components, c = x % components;
+		if ( !strcmp(pattern, "white") ) row[x] = 255;
+		else if ( !strcmp(pattern, "black") ) row[x] = 0;
+		else if ( !strcmp(pattern, "gray") ) row[x] = 128;
+		else row[x] = (unsigned char) (c == 0 ? px * 255 / width : c == 1 ? y * 255 / height :
+			255 - (px + y) * 255 / (width + height));
+	}
+}
+
+#endif